@@ -0,0 +1,137 @@
+#!/usr/bin/env node
+
+// Reads the records fiskc appends to its trace-file (one json object per
+// line) and prints per stage latency histograms. With --chrome <file> it
+// also writes the jobs in Chrome's trace event format for chrome://tracing
+// or Perfetto.
+
+const fs = require("fs");
+const argv = require("minimist")(process.argv.slice(2), { string: [ "chrome" ] });
+
+const stages = [ "ConnectedToScheduler", "AcquiredSlave", "ConnectedToSlave", "PreprocessFinished", "UploadedJob", "Finished" ];
+
+if (argv.help || !argv._.length) {
+    console.log("Usage: fisk-trace.js [--chrome out.json] [--slowest N] trace.jsonl...");
+    process.exit(argv.help ? 0 : 1);
+}
+
+let records = [];
+argv._.forEach(file => {
+    fs.readFileSync(file, "utf8").split("\n").forEach((line, idx) => {
+        if (!line)
+            return;
+        try {
+            records.push(JSON.parse(line));
+        } catch (err) {
+            console.error(`${file}:${idx + 1}: ${err.message}`);
+        }
+    });
+});
+records.sort((a, b) => a.start - b.start);
+
+// the time spent in each stage, a stage that wasn't reached ends the job
+function spans(record)
+{
+    let ret = [];
+    let last = 0;
+    const recorded = record.stages || {};
+    for (let i=0; i<stages.length; ++i) {
+        if (!(stages[i] in recorded))
+            break;
+        ret.push({ name: stages[i], start: last, duration: recorded[stages[i]] - last });
+        last = recorded[stages[i]];
+    }
+    if (last < record.duration)
+        ret.push({ name: record.result == "local" ? "Local" : "Exit", start: last, duration: record.duration - last });
+    return ret;
+}
+
+function percentile(sorted, p)
+{
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function histogram(name, values)
+{
+    if (!values.length)
+        return;
+    values.sort((a, b) => a - b);
+    console.log(`${name}: ${values.length} samples, p50 ${percentile(values, .5)}ms p90 ${percentile(values, .9)}ms p99 ${percentile(values, .99)}ms max ${values[values.length - 1]}ms`);
+    // power of two buckets
+    let buckets = [];
+    values.forEach(value => {
+        const bucket = value < 1 ? 0 : Math.floor(Math.log2(value)) + 1;
+        buckets[bucket] = (buckets[bucket] || 0) + 1;
+    });
+    const max = Math.max.apply(null, buckets.filter(x => x));
+    for (let i=0; i<buckets.length; ++i) {
+        if (!buckets[i])
+            continue;
+        const range = i ? `${Math.pow(2, i - 1)}-${Math.pow(2, i) - 1}` : "0";
+        console.log(`  ${range.padStart(12)}ms ${String(buckets[i]).padStart(7)} ${"#".repeat(Math.max(1, Math.round(buckets[i] / max * 50)))}`);
+    }
+}
+
+let results = {};
+let fallbacks = {};
+let perStage = {};
+let totals = [];
+let slotWaits = [];
+records.forEach(record => {
+    results[record.result] = (results[record.result] || 0) + 1;
+    if (record.fallback)
+        fallbacks[record.fallback] = (fallbacks[record.fallback] || 0) + 1;
+    spans(record).forEach(span => {
+        (perStage[span.name] || (perStage[span.name] = [])).push(span.duration);
+    });
+    totals.push(record.duration);
+    if (record.slotWait)
+        slotWaits.push(record.slotWait);
+});
+
+console.log(`${records.length} jobs: ${Object.keys(results).map(key => `${results[key]} ${key}`).join(", ")}`);
+Object.keys(fallbacks).sort((a, b) => fallbacks[b] - fallbacks[a]).forEach(key => {
+    console.log(`  ${String(fallbacks[key]).padStart(7)} ${key}`);
+});
+if (records.length) {
+    const first = records[0].start;
+    const last = Math.max.apply(null, records.map(record => record.start + record.duration));
+    console.log(`wall time ${last - first}ms, ${records.reduce((total, record) => total + (record.preprocessedBytes || 0), 0)} bytes preprocessed`);
+}
+console.log();
+stages.concat([ "Exit", "Local" ]).forEach(stage => histogram(stage, perStage[stage] || []));
+histogram("Preprocess slot wait", slotWaits);
+histogram("Total", totals);
+
+const slowest = parseInt(argv.slowest) || 10;
+if (slowest > 0) {
+    console.log(`\nSlowest ${slowest}:`);
+    records.slice().sort((a, b) => b.duration - a.duration).slice(0, slowest).forEach(record => {
+        console.log(`  ${String(record.duration).padStart(7)}ms ${record.result} ${record.source || "?"}${record.slave ? " on " + record.slave : ""}${record.fallback ? " (" + record.fallback + ")" : ""}`);
+    });
+}
+
+if (argv.chrome) {
+    // jobs are put on the first lane that's free when they start so
+    // concurrent jobs don't overlap
+    let lanes = [];
+    let events = [];
+    records.forEach(record => {
+        let lane = lanes.findIndex(end => end <= record.start);
+        if (lane == -1) {
+            lane = lanes.length;
+            lanes.push(0);
+        }
+        lanes[lane] = record.start + record.duration;
+        const args = { source: record.source, result: record.result, slave: record.slave, fallback: record.fallback,
+                       preprocessedBytes: record.preprocessedBytes, slotWait: record.slotWait, pid: record.pid };
+        events.push({ name: record.source || String(record.pid), cat: record.result, ph: "X", pid: 1, tid: lane,
+                      ts: record.start * 1000, dur: record.duration * 1000, args: args });
+        spans(record).forEach(span => {
+            events.push({ name: span.name, cat: "stage", ph: "X", pid: 1, tid: lane,
+                          ts: (record.start + span.start) * 1000, dur: span.duration * 1000 });
+        });
+    });
+    fs.writeFileSync(argv.chrome, JSON.stringify({ traceEvents: events, displayTimeUnit: "ms" }));
+    console.log(`\nWrote ${events.length} events to ${argv.chrome}`);
+}
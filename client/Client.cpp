@@ -3,14 +3,21 @@
 #include "Log.h"
 #include <unistd.h>
 #include "CompilerArgs.h"
+#include "CostModel.h"
+#include "Jobserver.h"
+#include "Resources.h"
 #include "SchedulerWebSocket.h"
 #include "Select.h"
+#include "SlotBroker.h"
+#include "Speculation.h"
 #include "Config.h"
 #include <unistd.h>
 #include <climits>
 #include <cstdlib>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <algorithm>
 #ifdef __linux__
@@ -20,7 +27,6 @@
 #include <sys/wait.h>
 #include <process.hpp>
 #ifdef __APPLE__
-#include <semaphore.h>
 #include <mach-o/dyld.h>
 #include <mach/mach.h>
 #include <mach/mach_time.h>
@@ -91,8 +97,75 @@ static std::string resolveSymlink(const std::string &link, const std::function<C
     return l;
 }
 
+// What findCompiler came up with is cached per argv[0], PATH and
+// preresolved compiler and is used for as long as the compiler we found is
+// the same file it was.
+static std::string compilerCacheFile(const std::string &preresolved)
+{
+    const std::string dir = Config::compilerCacheDir();
+    if (dir.empty())
+        return std::string();
+    std::string argv0;
+    Client::parsePath(sData.argv[0], &argv0, 0);
+    const char *path = getenv("PATH");
+    std::string key = argv0;
+    key += '\0';
+    key += path ? path : "";
+    key += '\0';
+    key += preresolved;
+    return dir + Client::toHex(Client::sha1(key));
+}
+
+static std::string compilerCacheStat(const struct stat &st)
+{
+    return Client::format("%llu %llu %llu %lld",
+                          static_cast<unsigned long long>(st.st_dev),
+                          static_cast<unsigned long long>(st.st_ino),
+                          static_cast<unsigned long long>(st.st_size),
+                          static_cast<long long>(Client::mtime(st)));
+}
+
+static bool loadCompilerCache(const std::string &file)
+{
+    const int fd = open(file.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char buf[PATH_MAX * 3 + 128];
+    ssize_t r;
+    do {
+        r = ::read(fd, buf, sizeof(buf));
+    } while (r == -1 && errno == EINTR);
+    ::close(fd);
+    if (r <= 0)
+        return false;
+    const std::vector<std::string> lines = Client::split(std::string(buf, r), "\n");
+    struct stat st;
+    if (lines.size() < 5 || lines[0] != "1" || lines[1].empty() || stat(lines[1].c_str(), &st) || lines[4] != compilerCacheStat(st))
+        return false;
+    sData.compiler = lines[1];
+    sData.resolvedCompiler = lines[2];
+    sData.slaveCompiler = lines[3];
+    DEBUG("Found compiler %s in %s", sData.compiler.c_str(), file.c_str());
+    return true;
+}
+
+static void storeCompilerCache(const std::string &file, const struct stat &st)
+{
+    const std::string contents = Client::format("1\n%s\n%s\n%s\n%s\n",
+                                                sData.compiler.c_str(), sData.resolvedCompiler.c_str(),
+                                                sData.slaveCompiler.c_str(), compilerCacheStat(st).c_str());
+    Client::recursiveMkdir(Config::compilerCacheDir());
+    Client::OutputFile out;
+    if (!out.open(file, contents.size()) || !out.write(contents.c_str(), contents.size()) || !out.commit())
+        DEBUG("Failed to write compiler cache %s", file.c_str());
+}
+
 bool Client::findCompiler(const std::string &preresolved)
 {
+    const std::string cacheFile = compilerCacheFile(preresolved);
+    if (!cacheFile.empty() && loadCompilerCache(cacheFile))
+        return true;
+
     // printf("PATH %s\n", path);
     std::string exec;
     if (!preresolved.empty()) {
@@ -232,7 +305,11 @@ bool Client::findCompiler(const std::string &preresolved)
     }
     sData.compiler = std::move(exec);
     struct stat st;
-    return !stat(sData.compiler.c_str(), &st) && (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode));
+    if (stat(sData.compiler.c_str(), &st) || !(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)))
+        return false;
+    if (!cacheFile.empty())
+        storeCompilerCache(cacheFile, st);
+    return true;
 }
 
 void Client::parsePath(const char *path, std::string *basename, std::string *dirname)
@@ -250,23 +327,48 @@ void Client::parsePath(const char *path, std::string *basename, std::string *dir
     }
 }
 
-Client::Slot::Slot(Type type, sem_t *semaphore)
-    : mType(type), mSemaphore(semaphore)
+size_t Client::Slot::slots(Type type)
+{
+    switch (type) {
+    case Compile:
+        // 0 is the default, the CPUs are only counted when a slot is needed
+        if (const size_t slots = Config::compileSlots)
+            return slots;
+        return Resources::cpuCount();
+    case Cpp:
+        if (const size_t slots = Config::cppSlots)
+            return slots;
+        return Resources::cpuCount() * 2;
+    case DesiredCompile:
+        return Config::desiredCompileSlots;
+    case Memory:
+        return Config::memoryBudget * 1024 * 1024;
+    }
+    assert(0);
+    return 0;
+}
+
+Client::Slot::Slot(Type type, int lease)
+    : mType(type), mLease(lease)
 {
-    if (semaphore) {
-        sData.semaphores.insert(semaphore);
-        DEBUG("Acquired %s semaphore on %s", typeToString(type), sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
+    if (lease >= 0) {
+        DEBUG("Acquired %s slot %d on %s", typeToString(type), lease, sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
     } else {
-        DEBUG("Acquired %s slot without semaphore for %s", typeToString(type), sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
+        DEBUG("Acquired %s slot without lease for %s", typeToString(type), sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
     }
 }
 
+void Client::Slot::resize(size_t bytes)
+{
+    if (mLease >= 0)
+        SlotBroker::resize(mLease, bytes);
+}
+
 Client::Slot::~Slot()
 {
-    if (mSemaphore) {
-        DEBUG("Dropping %s semaphore on %s", typeToString(mType), sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
-        sem_post(mSemaphore);
-        sData.semaphores.erase(mSemaphore);
+    if (mLease >= 0) {
+        DEBUG("Dropping %s slot %d on %s", typeToString(mType), mLease, sData.compilerArgs ? sData.compilerArgs->sourceFile().c_str() : "");
+        SlotBroker::release(mLease);
     }
 }
 
@@ -346,14 +448,35 @@ bool Client::recursiveRmdir(const std::string &dir)
     return ::rmdir(dir.c_str()) == 0;
 }
 
+std::string Client::schedulerUrl()
+{
+    // Config doesn't change after init so this is only worked out once
+    static const std::string url = []() {
+        std::string ret = Config::scheduler;
+        if (ret.find("://") == std::string::npos)
+            ret.insert(0, "ws://");
+
+        // append the default port unless it ends with :[0-9]+
+        size_t digits = 0;
+        while (digits < ret.size() && isdigit(static_cast<unsigned char>(ret[ret.size() - digits - 1])))
+            ++digits;
+        if (!digits || digits == ret.size() || ret[ret.size() - digits - 1] != ':')
+            ret.append(":8097");
+        return ret;
+    }();
+    return url;
+}
+
 std::unique_ptr<Client::Preprocessed> Client::preprocess(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args)
 {
     const unsigned long long started = Client::mono();
     Preprocessed *ptr = new Preprocessed;
     std::unique_ptr<Client::Preprocessed> ret(ptr);
+    if (Config::objectCache || Config::sharedObjectCache) {
+        ptr->mSha = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ptr->mSha, EVP_sha1(), nullptr);
+    }
     ret->mThread = std::thread([ptr, args, compiler, started] {
-            std::string out, err;
-            ptr->stdOut.reserve(1024 * 1024);
             std::string commandLine = compiler;
             const size_t count = args->commandLine.size();
             auto append = [&commandLine](const std::string &arg) {
@@ -400,8 +523,9 @@ std::unique_ptr<Client::Preprocessed> Client::preprocess(const std::string &comp
                 if (arg == "-MMD" || arg == "-MD" || arg == "-MM" || arg == "-M") {
                     hasDepFile = true;
                 } else if (arg == "-MF" && i + 1 < count) {
+                    depFile = args->commandLine.at(++i);
                     commandLine += " '";
-                    append(args->commandLine.at(++i));
+                    append(depFile);
                     commandLine += '\'';
                 }
             }
@@ -418,53 +542,31 @@ std::unique_ptr<Client::Preprocessed> Client::preprocess(const std::string &comp
                 }
                 DEBUG("Depfile is %s", depFile.c_str());
             }
+            const bool preprocessed = args->flags & (CompilerArgs::CPreprocessed
+                                                     |CompilerArgs::ObjectiveCPreprocessed
+                                                     |CompilerArgs::ObjectiveCPlusPlusPreprocessed
+                                                     |CompilerArgs::CPlusPlusPreprocessed);
+            if (!preprocessed) { // a mapped file doesn't cost us memory
+                // admitted by what preprocessing usually produces, corrected
+                // once we know
+                const size_t expected = SlotBroker::expectedBytes();
+                DEBUG("Acquiring %zu bytes of memory: %s", expected, commandLine.c_str());
+                std::unique_ptr<Client::Slot> memory = Client::acquireMemory(expected);
+                std::unique_lock<std::mutex> lock(ptr->mMutex);
+                if (!ptr->mMemoryReleased)
+                    ptr->mMemory = std::move(memory);
+            }
             DEBUG("Acquiring preprocess slot: %s", commandLine.c_str());
             std::shared_ptr<Client::Slot> slot = Client::acquireSlot(Client::Slot::Cpp);
             ptr->slotDuration = Client::mono() - started;
             DEBUG("Running preprocess: %s", commandLine.c_str());
-            if (args->flags & (CompilerArgs::CPreprocessed
-                               |CompilerArgs::ObjectiveCPreprocessed
-                               |CompilerArgs::ObjectiveCPlusPlusPreprocessed
-                               |CompilerArgs::CPlusPlusPreprocessed)) {
-                ptr->exitStatus = 0;
-                FILE *f;
-                long size = 0;
-                f = fopen(args->sourceFile().c_str(), "r");
-                if (!f) {
-                    DEBUG("Failed to open %s for reading (%d %s)", args->sourceFile().c_str(), errno, strerror(errno));
-                    ptr->exitStatus = 1;
-                    goto end;
-                }
-                if (fseek(f, 0, SEEK_END)) {
-                    DEBUG("Failed to fseek to end of %s (%d %s)", args->sourceFile().c_str(), errno, strerror(errno));
-                    ptr->exitStatus = 1;
-                    goto end;
-                }
-                size = ftell(f);
-                if (fseek(f, 0, SEEK_SET)) {
-                    DEBUG("Failed to fseek to beginning of %s (%d %s)", args->sourceFile().c_str(), errno, strerror(errno));
-                    ptr->exitStatus = 1;
-                    goto end;
-                }
-
-                if (size < 0) {
-                    DEBUG("Failed to ftell %s (%d %s)", args->sourceFile().c_str(), errno, strerror(errno));
-                    ptr->exitStatus = 1;
-                    goto end;
-                }
-                ptr->stdOut.resize(size);
-                if (fread(&ptr->stdOut[0], 1, size, f) != static_cast<size_t>(size)) {
-                    DEBUG("Failed to fread %s (%d %s)", args->sourceFile().c_str(), errno, strerror(errno));
-                    ptr->exitStatus = 1;
-                }
-          end:
-                if (f)
-                    fclose(f);
+            if (preprocessed) {
+                ptr->exitStatus = ptr->map(args->sourceFile()) ? 0 : 1;
             } else {
                 TinyProcessLib::Process proc(commandLine, std::string(),
                                              [ptr](const char *bytes, size_t n) {
                                                  DEBUG("Preprocess appending %zu bytes to stdout", n);
-                                                 ptr->stdOut.append(bytes, n);
+                                                 ptr->append(bytes, n);
                                              }, [ptr](const char *bytes, size_t n) {
                                                  DEBUG("Preprocess appending %zu bytes to stderr", n);
                                                  ptr->stdErr.append(bytes, n);
@@ -472,19 +574,153 @@ std::unique_ptr<Client::Preprocessed> Client::preprocess(const std::string &comp
                 ptr->exitStatus = proc.get_exit_status();
             }
             slot.reset();
-            std::unique_lock<std::mutex> lock(ptr->mMutex);
-            ptr->mDone = true;
-            ptr->duration = Client::mono() - started;
-            ptr->mCond.notify_one();
+            {
+                std::unique_lock<std::mutex> lock(ptr->mMutex);
+                if (ptr->mMemory)
+                    ptr->mMemory->resize(ptr->mSize);
+            }
             if (hasDepFile)
                 ptr->depFile = std::move(depFile);
+            ptr->duration = Client::mono() - started;
+            ptr->finish();
         });
     return ret;
 }
 
+void Client::Preprocessed::append(const char *data, size_t size)
+{
+    if (mSha) // only ever touched by the preprocess thread
+        EVP_DigestUpdate(mSha, data, size);
+    std::unique_lock<std::mutex> lock(mMutex);
+    mSize += size;
+    while (size) {
+        if (mChunks.empty() || mChunks.back().size() == ChunkSize) {
+            mChunks.emplace_back();
+            mChunks.back().reserve(ChunkSize);
+        }
+        std::string &back = mChunks.back();
+        const size_t bytes = std::min<size_t>(ChunkSize - back.size(), size);
+        back.append(data, bytes);
+        data += bytes;
+        size -= bytes;
+        if (back.size() == ChunkSize && mChunkCallback)
+            mChunkCallback();
+    }
+}
+
+bool Client::Preprocessed::map(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG("Failed to open %s for reading (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        DEBUG("Failed to stat %s (%d %s)", path.c_str(), errno, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    if (!st.st_size) {
+        ::close(fd);
+        return true;
+    }
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        DEBUG("Failed to mmap %s (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+    if (mSha)
+        EVP_DigestUpdate(mSha, mapped, st.st_size);
+    std::unique_lock<std::mutex> lock(mMutex);
+    mMapped = mapped;
+    mSize = st.st_size;
+    return true;
+}
+
+void Client::Preprocessed::finish()
+{
+    if (mSha) {
+        hash.resize(SHA_DIGEST_LENGTH);
+        EVP_DigestFinal_ex(mSha, reinterpret_cast<unsigned char *>(&hash[0]), nullptr);
+    }
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone = true;
+    if (mChunkCallback)
+        mChunkCallback();
+    mCond.notify_one();
+}
+
+bool Client::Preprocessed::isFinished()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mDone;
+}
+
+bool Client::Preprocessed::chunk(size_t idx, const char *&data, size_t &size)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mMapped) {
+        if (idx >= (mSize + ChunkSize - 1) / ChunkSize)
+            return false;
+        data = static_cast<const char *>(mMapped) + (idx * ChunkSize);
+        size = std::min<size_t>(ChunkSize, mSize - (idx * ChunkSize));
+        return true;
+    }
+    if (idx >= mChunks.size() || (!mDone && mChunks[idx].size() < ChunkSize))
+        return false;
+    data = mChunks[idx].c_str();
+    size = mChunks[idx].size();
+    return true;
+}
+
+size_t Client::Preprocessed::chunkCount()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mMapped)
+        return (mSize + ChunkSize - 1) / ChunkSize;
+    return mChunks.size();
+}
+
+size_t Client::Preprocessed::size()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mSize;
+}
+
+void Client::Preprocessed::setChunkCallback(std::function<void()> &&callback)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mChunkCallback = std::move(callback);
+}
+
+void Client::Preprocessed::discard()
+{
+    wait();
+    std::unique_lock<std::mutex> lock(mMutex);
+    std::deque<std::string>().swap(mChunks);
+    mMemory.reset();
+}
+
+void Client::Preprocessed::releaseMemory()
+{
+    std::unique_ptr<Slot> memory;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mMemoryReleased = true;
+        memory = std::move(mMemory);
+    }
+}
+
 Client::Preprocessed::~Preprocessed()
 {
     wait();
+    if (mMapped)
+        munmap(mMapped, mSize);
+    if (mSha)
+        EVP_MD_CTX_free(mSha);
 }
 
 void Client::Preprocessed::wait()
@@ -501,58 +737,261 @@ void Client::Preprocessed::wait()
     mThread.join();
 }
 
-std::unique_ptr<Client::Slot> Client::acquireSlot(Client::Slot::Type type)
-{
-    const size_t slots = Slot::slots(type);
-    if (!slots)
-        return std::unique_ptr<Client::Slot>();
+// the ones with a named temp file, for abortAll()
+static std::mutex sOutputFilesMutex;
+static std::set<Client::OutputFile *> sOutputFiles;
 
-    sem_t *sem = sem_open(Client::Slot::typeToString(type), O_CREAT, 0666, slots);
-    if (!sem) {
-        ERROR("Failed to open semaphore %s for %zu slots: %d %s",
-              Client::Slot::typeToString(type), slots, errno, strerror(errno));
-        return std::make_unique<Client::Slot>(type, nullptr);
+bool Client::OutputFile::open(const std::string &path, size_t size)
+{
+    abort();
+    mPath = path;
+    mSize = size;
+    mWritten = 0;
+    mDirect = false;
+    // Devices and FIFOs (-o /dev/null in configure checks) are written to,
+    // renaming a file over them would replace the device for everyone or
+    // fail for lack of permission to write in its directory
+    struct stat st;
+    if (!stat(path.c_str(), &st) && !S_ISREG(st.st_mode)) {
+        mFD = ::open(path.c_str(), O_WRONLY|O_CLOEXEC);
+        if (mFD == -1) {
+            ERROR("Failed to open %s for writing (%d %s)", path.c_str(), errno, strerror(errno));
+            return false;
+        }
+        mDirect = true;
+        return true;
+    }
+#ifdef O_TMPFILE
+    // commit() names it through /proc, which chroots and some sandboxes
+    // don't have
+    static const bool proc = !access("/proc/self/fd", X_OK);
+    if (proc) {
+        std::string dir;
+        Client::parsePath(path, 0, &dir);
+        mFD = ::open(dir.empty() ? "." : dir.c_str(), O_TMPFILE|O_WRONLY|O_CLOEXEC, 0666);
+    }
+#endif
+    if (mFD == -1) {
+        // not supported by the kernel or the file system, or no /proc
+        mTempPath = Client::format("%s.%d.tmp", path.c_str(), getpid());
+        mFD = ::open(mTempPath.c_str(), O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0666);
+        if (mFD == -1) {
+            ERROR("Failed to open %s for writing (%d %s)", mTempPath.c_str(), errno, strerror(errno));
+            mTempPath.clear();
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(sOutputFilesMutex);
+        sOutputFiles.insert(this);
     }
-    int ret;
-    do {
-        ret = sem_wait(sem);
-    } while (ret == -1 && errno == EINTR);
-
-    if (Log::minLogLevel <= Log::Debug) {
 #ifdef __linux__
-        int val = -1;
-        sem_getvalue(sem, &val);
-        Log::debug("Opened semaphore %s for %zu slots (value %d)", Client::Slot::typeToString(type), slots, val);
-#else
-        Log::debug("Opened semaphore %s for %zu slots", Client::Slot::typeToString(type), slots);
+    if (size && fallocate(mFD, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        ERROR("Failed to allocate %zu bytes for %s (%d %s)", size, path.c_str(), errno, strerror(errno));
+        abort();
+        return false;
+    }
 #endif
+    return true;
+}
+
+bool Client::OutputFile::write(const void *data, size_t len)
+{
+    assert(mFD != -1);
+    if (mWritten + len > mSize) {
+        ERROR("Too much data for %s (%zu/%zu)", mPath.c_str(), mWritten + len, mSize);
+        return false;
+    }
+    const char *ch = static_cast<const char *>(data);
+    while (len) {
+        const ssize_t w = ::write(mFD, ch, len);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            ERROR("Failed to write to file %s (%d %s)", mPath.c_str(), errno, strerror(errno));
+            return false;
+        }
+        ch += w;
+        len -= w;
+        mWritten += w;
+    }
+    return true;
+}
+
+bool Client::OutputFile::commit()
+{
+    assert(mFD != -1);
+    if (mWritten != mSize) {
+        ERROR("Incomplete file %s (%zu/%zu)", mPath.c_str(), mWritten, mSize);
+        abort();
+        return false;
+    }
+    if (mDirect) {
+        ::close(mFD);
+        mFD = -1;
+        return true;
     }
+    if (mTempPath.empty()) {
+        // give the O_TMPFILE a name next to the target and rename that
+        // over it, linkat can't replace an existing file
+        mTempPath = Client::format("%s.%d.tmp", mPath.c_str(), getpid());
+        const std::string proc = Client::format("/proc/self/fd/%d", mFD);
+        unlink(mTempPath.c_str());
+        if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, mTempPath.c_str(), AT_SYMLINK_FOLLOW) == -1) {
+            ERROR("Failed to link %s (%d %s)", mTempPath.c_str(), errno, strerror(errno));
+            mTempPath.clear();
+            abort();
+            return false;
+        }
+    }
+    ::close(mFD);
+    mFD = -1;
+    if (rename(mTempPath.c_str(), mPath.c_str())) {
+        ERROR("Failed to rename %s to %s (%d %s)", mTempPath.c_str(), mPath.c_str(), errno, strerror(errno));
+        abort();
+        return false;
+    }
+    mTempPath.clear();
+    std::lock_guard<std::mutex> lock(sOutputFilesMutex);
+    sOutputFiles.erase(this);
+    return true;
+}
 
-    assert(!ret);
-    return std::make_unique<Client::Slot>(type, sem);
+void Client::OutputFile::abort()
+{
+    if (mFD != -1) {
+        ::close(mFD);
+        mFD = -1;
+    }
+    if (!mTempPath.empty()) {
+        unlink(mTempPath.c_str());
+        mTempPath.clear();
+        std::lock_guard<std::mutex> lock(sOutputFilesMutex);
+        sOutputFiles.erase(this);
+    }
 }
 
-std::unique_ptr<Client::Slot> Client::tryAcquireSlot(Client::Slot::Type type)
+void Client::OutputFile::abortAll()
+{
+    std::set<OutputFile *> files;
+    {
+        std::lock_guard<std::mutex> lock(sOutputFilesMutex);
+        files.swap(sOutputFiles);
+    }
+    for (OutputFile *file : files)
+        file->abort();
+}
+
+Client::Priority Client::stringToPriority(const char *str, bool *ok)
 {
-    const size_t slots = Slot::slots(type);
-    if (!slots)
+    if (ok)
+        *ok = true;
+    if (!strcasecmp("interactive", str)) {
+        return Interactive;
+    } else if (!strcasecmp("normal", str)) {
+        return Normal;
+    } else if (!strcasecmp("background", str)) {
+        return Background;
+    }
+    if (ok)
+        *ok = false;
+    return Normal;
+}
+
+const char *Client::priorityToString(Priority priority)
+{
+    switch (priority) {
+    case Interactive: return "interactive";
+    case Normal: return "normal";
+    case Background: return "background";
+    }
+    return "";
+}
+
+Client::Priority Client::priority()
+{
+    static const Priority priority = []() {
+        const std::string str = Config::priority;
+        return stringToPriority(str.c_str(), nullptr);
+    }();
+    return priority;
+}
+
+static std::unique_ptr<Client::Slot> acquire(Client::Slot::Type type, bool wait, size_t units = 1)
+{
+    const size_t slots = Client::Slot::slots(type);
+    if (!slots && type != Client::Slot::Memory) // 0 is the automatic budget for memory
         return std::unique_ptr<Client::Slot>();
 
-    sem_t *sem = sem_open(Client::Slot::typeToString(type), O_CREAT, 0666, slots);
-    if (!sem) {
-        ERROR("Failed to open semaphore %s for %zu slots: %d %s",
-              Client::Slot::typeToString(type), slots, errno, strerror(errno));
-        return std::make_unique<Client::Slot>(type, nullptr);
+    // Compiling locally needs the jobserver token back if we lent it. It's
+    // taken before queuing for the slot, processes that never lent theirs
+    // hold a token while they wait for a slot so a slot mustn't be held
+    // while waiting for a token.
+    bool token = false;
+    if (type == Client::Slot::Compile || type == Client::Slot::DesiredCompile) {
+        // Waiting for a compile slot means building from source so the
+        // memory lease isn't needed, holding on to it could keep the
+        // processes we're waiting for from preprocessing.
+        if (wait && sData.preprocessed)
+            sData.preprocessed->releaseMemory();
+        token = Jobserver::isLent();
+        if (wait) {
+            Jobserver::acquire();
+        } else if (!Jobserver::tryAcquire()) {
+            return std::unique_ptr<Client::Slot>();
+        }
     }
-    int ret = sem_trywait(sem);
-    if (!ret) {
-        return std::make_unique<Client::Slot>(type, sem);
+
+    std::string what;
+    if (sData.compilerArgs)
+        Client::parsePath(sData.compilerArgs->sourceFile(), &what, nullptr);
+    const int lease = SlotBroker::acquire(type, slots, wait, what, units);
+    if (lease == SlotBroker::Busy) {
+        // still remote, the build tool can have it again
+        if (token)
+            Jobserver::lend();
+        return std::unique_ptr<Client::Slot>();
     }
-    return std::unique_ptr<Client::Slot>();
+    return std::make_unique<Client::Slot>(type, lease);
+}
+
+std::unique_ptr<Client::Slot> Client::acquireSlot(Client::Slot::Type type)
+{
+    // the speculative compile already holds one and runLocal() will wait
+    // for it rather than compile again
+    if (type == Slot::Compile && sData.speculation && sData.speculation->isRunning())
+        return std::unique_ptr<Client::Slot>();
+
+    return acquire(type, true);
 }
 
-void Client::runLocal(std::unique_ptr<Slot> &&slot)
+std::unique_ptr<Client::Slot> Client::tryAcquireSlot(Client::Slot::Type type)
 {
+    return acquire(type, false);
+}
+
+std::unique_ptr<Client::Slot> Client::acquireMemory(size_t bytes)
+{
+    return acquire(Slot::Memory, true, bytes);
+}
+
+void Client::runLocal(std::unique_ptr<Slot> &&slot, const char *reason)
+{
+    dumpPhases();
+    if (sData.watchdog)
+        sData.watchdog->save();
+    std::string fallback;
+    if (reason) {
+        fallback = reason;
+    } else if (sData.watchdog && sData.watchdog->stage() < Watchdog::Finished) {
+        fallback = Client::format("error before %s", Watchdog::stageName(static_cast<Watchdog::Stage>(sData.watchdog->stage() + 1)));
+    } else {
+        fallback = "error";
+    }
+    if (sData.speculation && sData.speculation->isRunning()) {
+        sData.speculation->finish(fallback);
+        // it didn't exit normally, build it ourselves
+        slot = acquireSlot(Slot::Compile);
+    }
+
     auto run = []() {
         char **argvCopy = new char*[sData.argc + 1];
         argvCopy[0] = strdup(sData.compiler.c_str());
@@ -564,6 +1003,7 @@ void Client::runLocal(std::unique_ptr<Slot> &&slot)
         ERROR("fisk: Failed to exec %s (%d %s)", sData.compiler.c_str(), errno, strerror(errno));
     };
 
+    const unsigned long long started = mono();
     const pid_t pid = fork();
     if (pid == -1) { // errpr
         ERROR("Failed to fork: %d %s", errno, strerror(errno));
@@ -575,10 +1015,17 @@ void Client::runLocal(std::unique_ptr<Slot> &&slot)
     } else { // paren
         int status;
         waitpid(pid, &status, 0);
+        const unsigned long long duration = mono() - started;
         slot.reset();
-        if (WIFEXITED(status))
-            _exit(WEXITSTATUS(status));
-        _exit(101);
+        sData.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 101;
+        // the size is only known if we got as far as preprocessing
+        if (sData.preprocessedBytes && !sData.exitCode)
+            CostModel::addLocal(sData.preprocessedBytes, duration);
+        writeTrace(fallback);
+        // the preprocess thread might still hold a slot
+        SlotBroker::releaseAll();
+        OutputFile::abortAll();
+        _exit(sData.exitCode);
     }
 }
 
@@ -620,6 +1067,223 @@ unsigned long long Client::mono()
     return 0;
 }
 
+static struct {
+    unsigned long long wall, cpu; // microseconds
+} sPhases[Client::PhaseCount];
+static bool sPhasesDumped = false;
+static const bool sStartedPhase = (Client::phase(Client::Started), true);
+
+void Client::phase(Phase phase)
+{
+    if (sPhases[phase].wall)
+        return;
+    timeval time;
+    timespec cpu;
+    if (gettime(&time))
+        sPhases[phase].wall = (time.tv_sec * static_cast<uint64_t>(1000000)) + time.tv_usec;
+    if (!::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu))
+        sPhases[phase].cpu = (cpu.tv_sec * static_cast<uint64_t>(1000000)) + (cpu.tv_nsec / 1000);
+    if (phase == SchedulerConnected)
+        dumpPhases();
+}
+
+void Client::dumpPhases()
+{
+    if (sPhasesDumped || !Config::profileStartup)
+        return;
+    sPhasesDumped = true;
+
+    static const char *names[] = {
+        "started", "config", "log", "compiler", "arguments", "environment", "scheduler-request", "scheduler-connect"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == PhaseCount, "Missing phase name");
+    (void)sStartedPhase;
+    // microseconds, wall/cpu since the previous phase that was reached
+    std::string str = Client::format("fiskc startup: pre-main=-/%llu", sPhases[Started].cpu);
+    size_t last = Started;
+    for (size_t i=Started + 1; i<PhaseCount; ++i) {
+        if (!sPhases[i].wall)
+            continue;
+        str += Client::format(" %s=%llu/%llu", names[i], sPhases[i].wall - sPhases[last].wall, sPhases[i].cpu - sPhases[last].cpu);
+        last = i;
+    }
+    str += Client::format(" total=%llu/%llu\n", sPhases[last].wall - sPhases[Started].wall, sPhases[last].cpu);
+    fwrite(str.c_str(), sizeof(char), str.size(), stderr);
+}
+
+void Client::writeTrace(const std::string &fallback)
+{
+    static bool written = false;
+    if (written || (!sData.compilerArgs && fallback.empty()))
+        return;
+    written = true;
+    const std::string file = Config::traceFile;
+    if (file.empty())
+        return;
+
+    // milliseconds, stages are relative to start
+    const unsigned long long now = Client::mono();
+    const unsigned long long epoch = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    json11::Json::object record {
+        { "pid", static_cast<int>(getpid()) },
+        { "start", static_cast<double>(epoch - (now - Client::started)) },
+        { "duration", static_cast<double>(now - Client::started) },
+        { "result", !fallback.empty() ? "local" : (sData.cacheHit ? "cache" : "remote") },
+        { "exitCode", sData.exitCode },
+        { "preprocessedBytes", static_cast<double>(sData.preprocessedBytes) },
+        { "preprocessDuration", static_cast<double>(sData.preprocessDuration) },
+        { "slotWait", static_cast<double>(sData.preprocessSlotDuration) }
+    };
+    if (!fallback.empty())
+        record["fallback"] = fallback;
+    if (!sData.slave.empty())
+        record["slave"] = sData.slave;
+    if (sData.compilerArgs)
+        record["source"] = sData.compilerArgs->sourceFile();
+    if (const Watchdog *watchdog = sData.watchdog) {
+        json11::Json::object stages;
+        for (size_t i=Watchdog::ConnectedToScheduler; i<=Watchdog::Finished; ++i) {
+            if (watchdog->timings[i])
+                stages[Watchdog::stageName(static_cast<Watchdog::Stage>(i))] = static_cast<double>(watchdog->timings[i] - Client::started);
+        }
+        record["stages"] = stages;
+    }
+
+    std::string line = json11::Json(record).dump();
+    line += '\n';
+    const int fd = ::open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        ERROR("Failed to open trace file %s: %d %s", file.c_str(), errno, strerror(errno));
+        return;
+    }
+    // one write so records from concurrent jobs don't interleave
+    ssize_t w;
+    while ((w = ::write(fd, line.c_str(), line.size())) == -1 && errno == EINTR);
+    if (w != static_cast<ssize_t>(line.size()))
+        ERROR("Failed to write to trace file %s: %d %s", file.c_str(), errno, strerror(errno));
+    ::close(fd);
+}
+
+// The environment cache is a header followed by fixed size records that
+// are only ever appended to, lookups mmap it and don't take any locks.
+// Writers serialize on a lock file next to it and once it has grown too
+// big the newest records are written to a new file that's renamed over it.
+namespace {
+struct EnvironmentRecord
+{
+    uint64_t device, inode, size;
+    int64_t mtime;
+    uint64_t path; // fnv1a of the path we were invoked with
+    char hash[40];
+    uint64_t checksum; // fnv1a of the above, so torn appends are ignored
+};
+enum {
+    EnvironmentCacheMagic = 0x31434546, // FEC1
+    MaxEnvironmentRecords = 256
+};
+}
+
+static uint64_t fnv1a(const void *data, size_t len)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i=0; i<len; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool matches(const EnvironmentRecord &record, const EnvironmentRecord &key)
+{
+    return (record.device == key.device
+            && record.inode == key.inode
+            && record.size == key.size
+            && record.mtime == key.mtime
+            && record.path == key.path
+            && record.checksum == fnv1a(&record, offsetof(EnvironmentRecord, checksum)));
+}
+
+static std::string findEnvironmentRecord(const std::string &cache, const EnvironmentRecord &key)
+{
+    const int fd = open(cache.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return std::string();
+    std::string ret;
+    struct stat st;
+    if (!fstat(fd, &st) && static_cast<size_t>(st.st_size) >= sizeof(uint32_t) + sizeof(EnvironmentRecord)) {
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            uint32_t magic;
+            memcpy(&magic, mapped, sizeof(magic));
+            if (magic == EnvironmentCacheMagic) {
+                const size_t count = (st.st_size - sizeof(uint32_t)) / sizeof(EnvironmentRecord);
+                const unsigned char *records = static_cast<const unsigned char *>(mapped) + sizeof(uint32_t);
+                for (size_t i=count; i>0; --i) { // newest first
+                    EnvironmentRecord record;
+                    memcpy(&record, records + ((i - 1) * sizeof(EnvironmentRecord)), sizeof(record));
+                    if (matches(record, key)) {
+                        ret.assign(record.hash, sizeof(record.hash));
+                        break;
+                    }
+                }
+            }
+            munmap(mapped, st.st_size);
+        }
+    }
+    ::close(fd);
+    return ret;
+}
+
+// Must be called with the lock held
+static void addEnvironmentRecord(const std::string &cache, const EnvironmentRecord &record)
+{
+    const int fd = open(cache.c_str(), O_CREAT|O_RDWR|O_APPEND|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (fd == -1) {
+        ERROR("Failed to open %s for writing (%d %s)", cache.c_str(), errno, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        ERROR("Failed to fstat %s (%d %s)", cache.c_str(), errno, strerror(errno));
+        ::close(fd);
+        return;
+    }
+    std::string data;
+    size_t count = 0;
+    uint32_t magic = 0;
+    if (static_cast<size_t>(st.st_size) >= sizeof(magic)) {
+        count = (st.st_size - sizeof(magic)) / sizeof(EnvironmentRecord);
+        if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+            magic = 0;
+    }
+    const bool valid = magic == EnvironmentCacheMagic;
+    if (!valid || count >= MaxEnvironmentRecords || (st.st_size - sizeof(magic)) % sizeof(EnvironmentRecord)) {
+        // start over with the newest records we have, in a new file
+        magic = EnvironmentCacheMagic;
+        data.append(reinterpret_cast<const char *>(&magic), sizeof(magic));
+        if (valid && count) {
+            const size_t keep = std::min<size_t>(count, MaxEnvironmentRecords / 2);
+            std::string records(keep * sizeof(EnvironmentRecord), ' ');
+            const off_t offset = sizeof(magic) + ((count - keep) * sizeof(EnvironmentRecord));
+            if (pread(fd, &records[0], records.size(), offset) == static_cast<ssize_t>(records.size()))
+                data += records;
+        }
+        data.append(reinterpret_cast<const char *>(&record), sizeof(record));
+        ::close(fd);
+        Client::OutputFile file;
+        if (!file.open(cache, data.size()) || !file.write(data.c_str(), data.size()) || !file.commit())
+            ERROR("Failed to rewrite %s", cache.c_str());
+        return;
+    }
+    if (write(fd, &record, sizeof(record)) != sizeof(record)) {
+        ERROR("Failed to write to file %s - %d %s", cache.c_str(), errno, strerror(errno));
+        if (ftruncate(fd, st.st_size))
+            ERROR("Failed to truncate file %s (%d %s)", cache.c_str(), errno, strerror(errno));
+    }
+    ::close(fd);
+}
+
 std::string Client::environmentHash(const std::string &compiler)
 {
     struct stat st;
@@ -649,82 +1313,52 @@ std::string Client::environmentHash(const std::string &compiler)
     if (cache.empty())
         return readSignature();
 
-    std::string key = Client::format("%s:%llu", compiler.c_str(), static_cast<unsigned long long>(st.st_mtime));
-    json11::Json::object json;
-    int fd;
-    if ((fd = open(cache.c_str(), O_CLOEXEC|O_RDONLY)) != -1) {
-        struct stat st;
-        if (flock(fd, LOCK_SH)) {
-            ERROR("Failed to flock shared %s (%d %s)", cache.c_str(), errno, strerror(errno));
-            ::close(fd);
-        } else if (fstat(fd, &st)) {
-            ERROR("Failed to fstat %s (%d %s)", cache.c_str(), errno, strerror(errno));
-            flock(fd, LOCK_UN);
-            ::close(fd);
-        } else {
-            const long size = st.st_size;
-            if (size) {
-                std::string contents(size, ' ');
-                const size_t read = ::read(fd, &contents[0], size);
-                flock(fd, LOCK_UN);
-                ::close(fd);
-                if (read != static_cast<size_t>(size)) {
-                    ERROR("Failed to read from file: %s (%d %s)", cache.c_str(), errno, strerror(errno));
-                } else {
-                    std::string err;
-                    json11::Json obj = json11::Json::parse(contents, err, json11::JsonParse::COMMENTS);
-                    if (!err.empty()) {
-                        ERROR("Failed to parse json from %s: %s", cache.c_str(), err.c_str());
-                    }
-                    if (obj.is_object()) {
-                        json11::Json value = obj[key];
-                        if (value.is_string()) {
-                            DEBUG("Cache hit for compiler %s", key.c_str());
-                            return value.string_value();
-                        }
-                        json = obj.object_items();
-                        auto it = json.begin();
-                        while (it != json.end()) {
-                            if (it->first.size() > compiler.size() && !strncmp(it->first.c_str(), compiler.c_str(), compiler.size()) && it->first[compiler.size()] == ':') {
-                                json.erase(it++);
-                            } else {
-                                ++it;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    } else {
-        DEBUG("Can't open %s for reading (%d %s)", cache.c_str(), errno, strerror(errno));
-    }
-    const std::string ret = readSignature();
+    EnvironmentRecord record;
+    memset(&record, 0, sizeof(record));
+    record.device = st.st_dev;
+    record.inode = st.st_ino;
+    record.size = st.st_size;
+    record.mtime = Client::mtime(st);
+    record.path = fnv1a(compiler.c_str(), compiler.size());
+
+    std::string ret = findEnvironmentRecord(cache, record);
     if (!ret.empty()) {
-        json[key] = ret;
-        std::string dirname;
-        parsePath(cache.c_str(), 0, &dirname);
-        recursiveMkdir(dirname);
-        if ((fd = open(cache.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH)) != -1) {
-            std::string str = json11::Json(json).dump();
-            if (flock(fd, LOCK_EX|LOCK_NB)) {
-                DEBUG("Failed to flock exclusive %s (%d %s)", cache.c_str(), errno, strerror(errno));
-                ::close(fd);
-                return ret;
-            }
-            if (write(fd, str.c_str(), str.size()) != static_cast<ssize_t>(str.size())) {
-                ERROR("Failed to write to file %s - %d %s", cache.c_str(), errno, strerror(errno));
-                unlink(cache.c_str());
-            } else {
-                if (ftruncate(fd, str.size())) {
-                    ERROR("Failed to truncate file %s (%d %s)", cache.c_str(), errno, strerror(errno));
-                }
-            }
-            flock(fd, LOCK_UN);
-            ::close(fd);
-        } else {
-            ERROR("Failed to open %s for writing %d %s", cache.c_str(), errno, strerror(errno));
+        DEBUG("Cache hit for compiler %s", compiler.c_str());
+        return ret;
+    }
+
+    // Only one of us gets to run -v, the others wait and find the result
+    std::string dirname;
+    parsePath(cache.c_str(), 0, &dirname);
+    recursiveMkdir(dirname);
+    const std::string lockFile = cache + ".lock";
+    const int lockFd = open(lockFile.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (lockFd == -1) {
+        ERROR("Failed to open %s (%d %s)", lockFile.c_str(), errno, strerror(errno));
+        return readSignature();
+    }
+    int err;
+    do {
+        err = flock(lockFd, LOCK_EX);
+    } while (err == -1 && errno == EINTR);
+    if (err) {
+        ERROR("Failed to flock exclusive %s (%d %s)", lockFile.c_str(), errno, strerror(errno));
+        ::close(lockFd);
+        return readSignature();
+    }
+    ret = findEnvironmentRecord(cache, record);
+    if (ret.empty()) {
+        ret = readSignature();
+        if (ret.size() == sizeof(record.hash)) {
+            memcpy(record.hash, ret.c_str(), sizeof(record.hash));
+            record.checksum = fnv1a(&record, offsetof(EnvironmentRecord, checksum));
+            addEnvironmentRecord(cache, record);
         }
+    } else {
+        DEBUG("Cache hit for compiler %s after waiting for the lock", compiler.c_str());
     }
+    flock(lockFd, LOCK_UN);
+    ::close(lockFd);
     return ret;
 }
 
@@ -739,17 +1373,28 @@ std::string Client::realpath(const std::string &path)
 
 std::string Client::base64(const std::string &src)
 {
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    BIO *sink = BIO_new(BIO_s_mem());
-    BIO_push(b64, sink);
-    BIO_write(b64, &src[0], src.size());
-    BIO_flush(b64);
-    const char *encoded;
-    const long len = BIO_get_mem_data(sink, &encoded);
-    std::string ret(encoded, len);
-    BIO_free(b64);
-    BIO_free(sink);
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string ret(((src.size() + 2) / 3) * 4, '=');
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(src.c_str());
+    char *out = &ret[0];
+    size_t remaining = src.size();
+    while (remaining >= 3) {
+        *out++ = alphabet[in[0] >> 2];
+        *out++ = alphabet[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        *out++ = alphabet[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+        *out++ = alphabet[in[2] & 0x3f];
+        in += 3;
+        remaining -= 3;
+    }
+    if (remaining) {
+        *out++ = alphabet[in[0] >> 2];
+        if (remaining == 1) {
+            *out++ = alphabet[(in[0] & 0x03) << 4];
+        } else {
+            *out++ = alphabet[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+            *out++ = alphabet[(in[1] & 0x0f) << 2];
+        }
+    }
     return ret;
 }
 
@@ -834,7 +1479,8 @@ bool Client::uploadEnvironment(SchedulerWebSocket *schedulerWebSocket, const std
                 Client::recursiveRmdir(dir);
                 return false;
             }
-            schedulerWebSocket->send(WebSocket::Binary, buf, chunkSize);
+            // buf isn't touched again until it's been sent
+            schedulerWebSocket->send(WebSocket::Binary, buf, chunkSize, WebSocket::Borrow);
             DEBUG("Sending %zu bytes %zu/%zu sent", chunkSize, sent, static_cast<size_t>(st.st_size));
             while (schedulerWebSocket->hasPendingSendData() && schedulerWebSocket->state() == SchedulerWebSocket::ConnectedWebSocket)
                 select.exec();
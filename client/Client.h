@@ -5,14 +5,15 @@
 #include <assert.h>
 #include <condition_variable>
 #include <cstdarg>
+#include <deque>
 #include <fcntl.h>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
-#include <semaphore.h>
 #include <set>
+#include <stdint.h>
 #include <string.h>
 #include <string>
 #include <sys/stat.h>
@@ -21,25 +22,34 @@
 #include <vector>
 
 class Watchdog;
+class Speculation;
 struct CompilerArgs;
 class SchedulerWebSocket;
 namespace Client {
+class Preprocessed;
 struct Data
 {
     ~Data() {}
 
     int argc { 0 };
     char **argv { 0 };
-    bool maintainSemaphores { false };
     std::string compiler; // this is the next one on the path and the one we will exec if we run locally
     std::string resolvedCompiler; // this one resolves g++ to gcc and is used for generating hash
     std::string slaveCompiler; // this is the one that actually will exist on the slave
     std::string hash;
     int exitCode { 0 };
-    std::set<sem_t *> semaphores;
 
     std::shared_ptr<CompilerArgs> compilerArgs;
     Watchdog *watchdog { 0 };
+    Speculation *speculation { 0 };
+    Preprocessed *preprocessed { 0 };
+
+    // for the trace record
+    std::string slave;
+    size_t preprocessedBytes { 0 };
+    unsigned long long preprocessDuration { 0 };
+    unsigned long long preprocessSlotDuration { 0 };
+    bool cacheHit { false };
 };
 Data &data();
 
@@ -58,40 +68,75 @@ public:
     enum Type {
         DesiredCompile,
         Compile,
-        Cpp
+        Cpp,
+        Memory // bytes of preprocessed output rather than a number of slots
     };
 
-    Slot(Type type, sem_t *sem);
+    // lease is SlotBroker's, -1 if we couldn't get one
+    Slot(Type type, int lease);
     ~Slot();
+    // for Memory, the bytes actually used once that's known
+    void resize(size_t bytes);
     static constexpr const char *typeToString(Type type)
-    {
-        return (type == Compile ? "/fisk.compile" : (type == DesiredCompile ? "/fisk.desiredCompile" : "/fisk.cpp"));
-    }
-    static size_t slots(Type type)
     {
         switch (type) {
-        case Compile:
-            return Config::compileSlots;
-        case Cpp:
-            return Config::cppSlots;
-        case DesiredCompile:
-            return Config::desiredCompileSlots;
+        case Compile: return "/fisk.compile";
+        case DesiredCompile: return "/fisk.desiredCompile";
+        case Cpp: return "/fisk.cpp";
+        case Memory: return "/fisk.memory";
         }
-        assert(0);
-        return 0;
+        return "";
     }
+    // the configured number, 0 for Memory means the automatic budget
+    static size_t slots(Type type);
 private:
     Slot(const Slot &) = delete;
     Slot &operator=(const Slot &) = delete;
 
     const Type mType;
-    sem_t *mSemaphore;
+    const int mLease;
 };
 
 std::unique_ptr<Slot> tryAcquireSlot(Slot::Type type);
 std::unique_ptr<Slot> acquireSlot(Slot::Type type);
-[[noreturn]] void runLocal(std::unique_ptr<Slot> &&slot);
+// waits until bytes fit in the memory budget
+std::unique_ptr<Slot> acquireMemory(size_t bytes);
+// The class of this build's jobs (priority). Waiting jobs get local slots
+// in this order, highest first, and the scheduler is told so it can keep
+// the busiest slaves for the others.
+enum Priority {
+    Background,
+    Normal,
+    Interactive
+};
+Priority stringToPriority(const char *str, bool *ok);
+const char *priorityToString(Priority priority);
+Priority priority();
+// reason ends up in the trace record, when it's not given the stage the
+// watchdog was waiting for is used instead
+[[noreturn]] void runLocal(std::unique_ptr<Slot> &&slot, const char *reason = nullptr);
 unsigned long long mono();
+
+// Wall and cpu time are recorded when each phase is reached (a couple of
+// clock reads, so always on) and dumpPhases() prints the deltas to stderr
+// when profile-startup is set. Started is taken from a static initializer
+// so anything before main only shows up in its cpu time.
+enum Phase {
+    Started,
+    ConfigLoaded,
+    LogOpened,
+    CompilerResolved,
+    ArgumentsParsed,
+    EnvironmentHashed,
+    SchedulerRequested,
+    SchedulerConnected,
+    PhaseCount
+};
+void phase(Phase phase);
+void dumpPhases();
+// Appends a json line describing this job to trace-file, a non-empty
+// fallback means the job was built locally. Only the first call writes.
+void writeTrace(const std::string &fallback = std::string());
 bool setFlag(int fd, int flag);
 bool recursiveMkdir(const std::string &path, mode_t mode = S_IRWXU);
 bool recursiveRmdir(const std::string &path);
@@ -102,22 +147,86 @@ class Preprocessed
 public:
     ~Preprocessed();
     void wait();
+    bool isFinished();
+
+    // stdout is collected in fixed size chunks so that completed chunks can
+    // be uploaded while cpp is still running. Returns false if chunk idx
+    // isn't complete yet. Completed chunks are never modified or moved.
+    // Already preprocessed sources are mmapped and the chunks point into the
+    // mapping.
+    enum { ChunkSize = 1024 * 256 };
+    bool chunk(size_t idx, const char *&data, size_t &size);
+    size_t chunkCount();
+    size_t size();
+    // called from the preprocess thread whenever a chunk completes
+    void setChunkCallback(std::function<void()> &&callback);
+    // Frees the output once it's been uploaded, along with its share of the
+    // memory budget. Only size() still works after this.
+    void discard();
+    // Gives back the share of the memory budget without waiting for cpp,
+    // for a job that's going to build from source instead. The output
+    // stays readable.
+    void releaseMemory();
 
-    std::string stdOut, stdErr;
+    std::string stdErr;
     int exitStatus { -1 };
     unsigned long long duration { 0 };
     unsigned long long slotDuration { 0 };
     std::string depFile;
+    // sha1 of stdout, only calculated when one of the object caches is enabled
+    std::string hash;
 private:
+    void append(const char *data, size_t size);
+    bool map(const std::string &path);
+    void finish();
+
     std::mutex mMutex;
     std::condition_variable mCond;
     std::thread mThread;
+    std::deque<std::string> mChunks;
+    size_t mSize { 0 };
+    void *mMapped { nullptr };
+    std::unique_ptr<Slot> mMemory;
+    std::function<void()> mChunkCallback;
+    EVP_MD_CTX *mSha { nullptr };
     bool mDone { false };
     bool mJoined { false };
+    bool mMemoryReleased { false };
     friend std::unique_ptr<Preprocessed> preprocess(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args);
 };
 std::unique_ptr<Preprocessed> preprocess(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args);
 
+// A file that only appears at path once commit() succeeds, until then it's
+// an O_TMPFILE (or a temp file next to it where that's not supported) so a
+// job that dies halfway through never leaves a truncated file behind. A
+// path that exists and isn't a regular file, like /dev/null, is written to
+// directly.
+class OutputFile
+{
+public:
+    OutputFile() {}
+    ~OutputFile() { abort(); }
+
+    // size is preallocated and commit() fails unless exactly size bytes
+    // were written
+    bool open(const std::string &path, size_t size);
+    bool write(const void *data, size_t len);
+    bool commit();
+    void abort();
+    bool isOpen() const { return mFD != -1; }
+    // for before _exit(), which doesn't run the destructors that would
+    // remove the temp files
+    static void abortAll();
+private:
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    std::string mPath, mTempPath;
+    int mFD { -1 };
+    size_t mSize { 0 }, mWritten { 0 };
+    bool mDirect { false }; // not a regular file, written in place
+};
+
 template <size_t StaticBufSize = 4096>
 static std::string vformat(const char *format, va_list args)
 {
@@ -194,6 +303,16 @@ inline std::vector<std::string> split(const std::string &str, const std::string
     return ret;
 }
 
+// nanoseconds
+inline int64_t mtime(const struct stat &st)
+{
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#endif
+}
+
 enum FileType {
     File,
     Directory,
@@ -222,6 +341,7 @@ inline FileType fileType(const std::string &path, struct stat *st = 0)
 }
 
 std::string environmentHash(const std::string &compiler);
+std::string schedulerUrl();
 std::string findExecutablePath(const char *argv0);
 bool uploadEnvironment(SchedulerWebSocket *schedulerWebSocket, const std::string &tarball);
 std::string prepareEnvironmentForUpload();
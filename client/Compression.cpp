@@ -0,0 +1,147 @@
+#include "Compression.h"
+#include "Log.h"
+#include <assert.h>
+#include <string.h>
+
+Deflater::Deflater()
+{
+    memset(&mStream, 0, sizeof(mStream));
+}
+
+Deflater::~Deflater()
+{
+    if (mInitialized)
+        deflateEnd(&mStream);
+}
+
+bool Deflater::init(int level)
+{
+    assert(!mInitialized);
+    const int ret = deflateInit2(&mStream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        ERROR("Failed to initialize deflate stream: %d", ret);
+        return false;
+    }
+    mInitialized = true;
+    mLevel = mPendingLevel = level;
+    return true;
+}
+
+bool Deflater::compress(const void *data, size_t size, std::string &out)
+{
+    assert(mInitialized);
+    if (mPendingLevel != mLevel) {
+        // everything up until now has been sync flushed so there's nothing
+        // pending that deflateParams would have to write out
+        unsigned char buf[64];
+        mStream.next_in = 0;
+        mStream.avail_in = 0;
+        mStream.next_out = buf;
+        mStream.avail_out = sizeof(buf);
+        if (deflateParams(&mStream, mPendingLevel, Z_DEFAULT_STRATEGY) == Z_OK) {
+            DEBUG("Changed compression level from %d to %d", mLevel, mPendingLevel);
+            mLevel = mPendingLevel;
+        } else {
+            mPendingLevel = mLevel;
+        }
+        out.append(reinterpret_cast<const char *>(buf), sizeof(buf) - mStream.avail_out);
+    }
+    mStream.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    mStream.avail_in = size;
+    return run(Z_SYNC_FLUSH, out);
+}
+
+bool Deflater::finish(std::string &out)
+{
+    assert(mInitialized);
+    mStream.next_in = 0;
+    mStream.avail_in = 0;
+    return run(Z_FINISH, out);
+}
+
+bool Deflater::run(int flush, std::string &out)
+{
+    unsigned char buf[1024 * 64];
+    do {
+        mStream.next_out = buf;
+        mStream.avail_out = sizeof(buf);
+        const int ret = deflate(&mStream, flush);
+        if (ret == Z_STREAM_ERROR) {
+            ERROR("Failed to deflate: %d", ret);
+            return false;
+        }
+        out.append(reinterpret_cast<const char *>(buf), sizeof(buf) - mStream.avail_out);
+    } while (!mStream.avail_out);
+    assert(!mStream.avail_in);
+    return true;
+}
+
+int Deflater::levelForLinkSpeed(unsigned long long bytesPerSecond)
+{
+    // Faster levels when the link is fast enough that compression time would
+    // dominate, harder ones when we're waiting for the network anyway.
+    if (bytesPerSecond >= 50ull * 1024 * 1024)
+        return 1;
+    if (bytesPerSecond >= 10ull * 1024 * 1024)
+        return 4;
+    return 6;
+}
+
+Inflater::Inflater()
+{
+    memset(&mStream, 0, sizeof(mStream));
+}
+
+Inflater::~Inflater()
+{
+    if (mInitialized)
+        inflateEnd(&mStream);
+}
+
+bool Inflater::init()
+{
+    assert(!mInitialized);
+    const int ret = inflateInit2(&mStream, -MAX_WBITS);
+    if (ret != Z_OK) {
+        ERROR("Failed to initialize inflate stream: %d", ret);
+        return false;
+    }
+    mInitialized = true;
+    return true;
+}
+
+bool Inflater::inflate(const void *data, size_t size, const std::function<bool(const unsigned char *, size_t)> &callback)
+{
+    assert(mInitialized);
+    mStream.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    mStream.avail_in = size;
+    unsigned char buf[1024 * 64];
+    while (!mFinished) {
+        mStream.next_out = buf;
+        mStream.avail_out = sizeof(buf);
+        const int ret = ::inflate(&mStream, Z_NO_FLUSH);
+        switch (ret) {
+        case Z_STREAM_END:
+            mFinished = true;
+            break;
+        case Z_OK:
+            break;
+        case Z_BUF_ERROR: // needs more input
+            assert(!mStream.avail_in);
+            return true;
+        default:
+            ERROR("Failed to inflate: %d %s", ret, mStream.msg ? mStream.msg : "");
+            return false;
+        }
+        const size_t produced = sizeof(buf) - mStream.avail_out;
+        if (produced && !callback(buf, produced))
+            return false;
+        if (!mStream.avail_in && mStream.avail_out)
+            break;
+    }
+    if (mStream.avail_in) {
+        ERROR("Extraneous bytes after end of deflate stream (%u)", mStream.avail_in);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <functional>
+#include <string>
+#include <zlib.h>
+
+// Raw deflate streams, negotiated with the slave through the
+// x-fisk-compression handshake header.
+class Deflater
+{
+public:
+    Deflater();
+    ~Deflater();
+
+    bool init(int level);
+    // Takes effect for the next call to compress()
+    void setLevel(int level) { mPendingLevel = level; }
+    int level() const { return mLevel; }
+
+    // Appends the compressed data to out. Every call ends with a sync flush
+    // so the receiver can inflate what it has got so far.
+    bool compress(const void *data, size_t size, std::string &out);
+    bool finish(std::string &out);
+
+    static int levelForLinkSpeed(unsigned long long bytesPerSecond);
+private:
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+    bool run(int flush, std::string &out);
+
+    z_stream mStream;
+    bool mInitialized { false };
+    int mLevel { Z_DEFAULT_COMPRESSION };
+    int mPendingLevel { Z_DEFAULT_COMPRESSION };
+};
+
+class Inflater
+{
+public:
+    Inflater();
+    ~Inflater();
+
+    bool init();
+    // Calls callback with each block of inflated data. Returns false if the
+    // data is corrupt or the callback returns false.
+    bool inflate(const void *data, size_t size, const std::function<bool(const unsigned char *, size_t)> &callback);
+    bool isFinished() const { return mFinished; }
+private:
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    z_stream mStream;
+    bool mInitialized { false };
+    bool mFinished { false };
+};
+
+#endif /* COMPRESSION_H */
@@ -1,10 +1,10 @@
 #include "Config.h"
 #include "Client.h"
 #include "Log.h"
+#include <climits>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
-#include <thread>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/file.h>
@@ -56,9 +56,17 @@ Getter<std::string> slave("slave", "Set to hostname, name or ip if you have a pr
 Separator s2;
 Separator s3("Options:");
 Getter<bool> disabled("disabled", "Set to true if you don't want to distribute this job", false);
+Getter<bool> speculate("speculate", "Race a local compile against the remote job when a compile slot is free", false);
+Getter<bool> costModel("cost-model", "Compile locally or remotely depending on which is expected to be faster for the job's preprocessed size", false);
 Getter<bool> noDesire("no-desire", "Set to true if you want to override desired-slots to for this job", false);
+Getter<bool> daemon("daemon", "Run as a daemon that keeps a connection to the scheduler open for other invocations of fiskc", false);
 Getter<bool> watchdog("watchdog", "Whether watchdog is enabled", true);
 Getter<bool> discardComments("discard-comments", "Discard comments when preprocessing", true);
+Getter<int> compressionLevel("compression-level", "Compression level for uploads (0 to disable, -1 to pick from measured link speed)", -1,
+                              [](const int &value) { return std::min(value, 9); });
+Getter<bool> objectCache("object-cache", "Cache compile results locally, keyed on the preprocessed output", false);
+Getter<bool> sharedObjectCache("shared-object-cache", "Ask the slave for a cached result before uploading", false);
+Getter<size_t> objectCacheSize("object-cache-size", "Max size of the object cache in MB", 5 * 1024);
 Getter<std::string> nodePath("node-path", "Path to nodejs executable", "node");
 Separator s4("Timeouts:");
 Getter<unsigned long long> schedulerConnectTimeout("scheduler-connect-timeout", "Set scheduler connect watchdog timeout", 3000);
@@ -67,6 +75,7 @@ Getter<unsigned long long> slaveConnectTimeout("slave-connect-timeout", "Set sla
 Getter<unsigned long long> preprocessTimeout("preprocess-timeout", "Set preprocess watchdog timeout", 3000);
 Getter<unsigned long long> uploadJobTimeout("upload-job-timeout", "Set upload job watchdog timeout", 5000);
 Getter<unsigned long long> responseTimeout("response-timeout", "Set response watchdog timeout (resets for every heartbeat (5s))", 10000); // restarts on each heartbeat which happen every 5 seconds
+Getter<bool> adaptiveTimeouts("adaptive-timeouts", "Derive the watchdog timeouts (except response) from recorded stage durations, never longer than the configured ones or shorter than a quarter of them", true);
 Getter<std::string> compiler("compiler", "Set fiskc's resolved compiler");
 Getter<std::string> cacheDir("cache-dir", "Set fiskc's cache dir", getenv("HOME") ? std::string(getenv("HOME") + std::string("/.cache/fisk/client/")) : std::string(),
                              [](const std::string &value) {
@@ -78,9 +87,14 @@ Getter<std::string> cacheDir("cache-dir", "Set fiskc's cache dir", getenv("HOME"
                              });
 Separator s5;
 Separator s6("CPU allowances:");
-Getter<size_t> compileSlots("slots", "Number of compile slots", std::thread::hardware_concurrency(), [](const size_t &value) { return std::max<size_t>(1, value); });
+Getter<size_t> compileSlots("slots", "Number of compile slots (0 for the CPUs our affinity mask and cgroup cpu quota allow)", 0);
 Getter<size_t> desiredCompileSlots("desired-slots", "Number of desired compile slots", 0);
-Getter<size_t> cppSlots("cpp-slots", "Number of preprocess slots", std::thread::hardware_concurrency() * 2, [](const size_t &value) { return std::max<size_t>(1, value); });
+Getter<size_t> cppSlots("cpp-slots", "Number of preprocess slots (0 for twice the number of compile slots the CPUs allow)", 0);
+Getter<bool> jobserver("jobserver", "Give the make/ninja jobserver token back while compiling remotely and take it again to compile locally", true);
+Getter<size_t> memoryBudget("memory-budget", "MB of preprocessed output the fiskc processes on this machine may hold at once (0 for half of what the cgroup or machine has available)", 0);
+Getter<bool> adaptiveSlots("adaptive-slots", "Hand out fewer compile and preprocess slots while other work keeps the CPUs busy (load average, CPU pressure)", true);
+Getter<std::string> priority("priority", "Class of this build's jobs, local slots go to \"interactive\" jobs before \"normal\" ones and to those before \"background\" ones", "normal");
+Getter<size_t> backgroundSlots("background-slots", "Most compile or preprocess slots background jobs on this machine may hold at once (0 for no limit)", 0);
 
 Separator s7;
 Separator s8("Identity:");
@@ -109,55 +123,148 @@ Getter<std::string> logLevel("log-level", "Log level (Level can be: \"debug\", \
 #endif
     );
 Getter<bool> verbose("verbose", "Set log level to \"debug\"", false);
+Getter<std::string> traceFile("trace-file", "Append a json line with timings for each job to this file (see bin/fisk-trace.js)");
+Getter<bool> profileStartup("profile-startup", "Print wall and cpu time for each of fiskc's startup phases to stderr", false);
 Separator s11;
 Separator s12("Semaphores:");
-Getter<bool> dumpSemaphores("dump-semaphores", "Dump info about fiskc's semaphores", false);
-Getter<bool> cleanSemaphores("clean-semaphores", "Clean fiskc's semaphores", false);
+Getter<bool> dumpSemaphores("dump-semaphores", "Dump fiskc's slots, who holds them and who's waiting", false);
+Getter<bool> cleanSemaphores("clean-semaphores", "Remove fiskc's slots file", false);
+#ifdef __linux__
+Getter<std::string> slotsFile("slots-file", "File shared by all fiskc processes for handing out slots", "/dev/shm/fisk.slots");
+#else
+Getter<std::string> slotsFile("slots-file", "File shared by all fiskc processes for handing out slots", "/tmp/fisk.slots");
+#endif
 
 };
 
-bool Config::init(int &argc, char **&argv)
+// Wipes the cache dir if it was created by a different version of fiskc
+static void checkVersion(const std::string &dir)
 {
-    std::vector<json11::Json> jsons;
-    auto load = [](const std::string &path, std::vector<json11::Json> &j) {
-        FILE *f = fopen(path.c_str(), "r");
-        if (!f)
-            return true;
-        fseek(f, 0, SEEK_END);
-        const long size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        if (!size) {
-            fclose(f);
-            return false;
+    std::string versionFile = dir + "version";
+    int fd = open(versionFile.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd != -1) {
+        flock(fd, LOCK_SH); // what if it fails?
+        uint32_t version;
+        if (read(fd, &version, sizeof(version)) == sizeof(version)) {
+            flock(fd, LOCK_UN); // what if it fails?
+            ::close(fd);
+            if (version == htonl(Config::Version)) {
+                return;
+            }
         }
+    }
+    Client::recursiveRmdir(dir);
+    Client::recursiveMkdir(dir);
 
-        std::string contents(size, ' ');
-        const size_t read = fread(&contents[0], 1, size, f);
-        fclose(f);
-        if (read != static_cast<size_t>(size)) {
-            fprintf(stderr, "Failed to read from file: %s (%d %s)\n", path.c_str(), errno, strerror(errno));
-            return false;
+    fd = open(versionFile.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (fd != -1) {
+        flock(fd, LOCK_EX); // what if it fails?
+        const uint32_t version = htonl(Config::Version);
+        if (write(fd, &version, sizeof(version)) != sizeof(version)) {
+            ERROR("Failed to log");
         }
+        flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+}
+
+
+// The config files are merged into a snapshot in the cache dir that's used
+// for as long as none of the files have changed. It holds the config
+// files' paths, mtimes and sizes, followed by the values they set.
+enum { SnapshotMagic = 0x31534346 }; // FCS1
+
+static void appendString(std::string &out, const std::string &str)
+{
+    const uint32_t size = str.size();
+    out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    out += str;
+}
 
-        std::string err;
-        json11::Json parsed = json11::Json::parse(contents, err, json11::JsonParse::COMMENTS);
-        if (!err.empty()) {
-            fprintf(stderr, "Failed to parse json from %s: %s\n", path.c_str(), err.c_str());
+static void appendFileInfo(std::string &out, const std::string &path)
+{
+    struct stat st;
+    int64_t info[2] = { -1, -1 };
+    if (!stat(path.c_str(), &st)) {
+        info[0] = Client::mtime(st);
+        info[1] = st.st_size;
+    }
+    out.append(reinterpret_cast<const char *>(info), sizeof(info));
+}
+
+static std::string snapshotHeader(const std::vector<std::string> &paths)
+{
+    std::string ret;
+    const uint32_t header[] = { SnapshotMagic, Config::Version, static_cast<uint32_t>(paths.size()) };
+    ret.append(reinterpret_cast<const char *>(header), sizeof(header));
+    for (const std::string &path : paths) {
+        appendString(ret, path);
+        appendFileInfo(ret, path);
+    }
+    return ret;
+}
+
+static bool loadSnapshot(const std::string &snapshot, const std::vector<std::string> &paths,
+                         std::vector<std::pair<std::string, std::string> > &values)
+{
+    const int fd = open(snapshot.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    std::string contents;
+    if (!fstat(fd, &st)) {
+        contents.resize(st.st_size);
+        if (read(fd, &contents[0], contents.size()) != static_cast<ssize_t>(contents.size()))
+            contents.clear();
+    }
+    ::close(fd);
+
+    const std::string header = snapshotHeader(paths);
+    if (contents.size() < header.size() + sizeof(uint32_t) || contents.compare(0, header.size(), header))
+        return false;
+    size_t offset = header.size();
+    auto readString = [&contents, &offset](std::string &out) {
+        uint32_t size;
+        if (offset + sizeof(size) > contents.size())
             return false;
-        }
-        j.push_back(std::move(parsed));
+        memcpy(&size, &contents[offset], sizeof(size));
+        offset += sizeof(size);
+        if (offset + size > contents.size())
+            return false;
+        out.assign(contents, offset, size);
+        offset += size;
         return true;
     };
-    if (const char *home = getenv("HOME")) {
-        if (!load(std::string(home) + "/.config/fisk/client.conf", jsons)) {
+    uint32_t count;
+    memcpy(&count, &contents[offset], sizeof(count));
+    offset += sizeof(count);
+    values.resize(count);
+    for (std::pair<std::string, std::string> &value : values) {
+        if (!readString(value.first) || !readString(value.second) || Config::sGetters.find(value.first) == Config::sGetters.end()) {
+            values.clear();
             return false;
         }
     }
-    if (!load("/etc/xdg/fisk/client.conf", jsons))
-        return false;
-    if (!load("/etc/xdg/fisk/client.conf.override", jsons))
-        return false;
+    return offset == contents.size();
+}
 
+static void writeSnapshot(const std::string &snapshot, const std::vector<std::string> &paths,
+                          const std::vector<std::pair<std::string, std::string> > &values)
+{
+    std::string contents = snapshotHeader(paths);
+    const uint32_t count = values.size();
+    contents.append(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (const std::pair<std::string, std::string> &value : values) {
+        appendString(contents, value.first);
+        appendString(contents, value.second);
+    }
+    Client::OutputFile file;
+    if (!file.open(snapshot, contents.size()) || !file.write(contents.c_str(), contents.size()) || !file.commit())
+        DEBUG("Failed to write config snapshot %s", snapshot.c_str());
+}
+
+bool Config::init(int &argc, char **&argv)
+{
     std::map<std::string, std::string> commandLine, environmentVariables;
     int i = 1;
     auto consumeArg = [&i, &argv, &argc](int extra) {
@@ -283,45 +390,92 @@ bool Config::init(int &argc, char **&argv)
         }
     }
 
-    for (const std::pair<std::string, GetterBase *> &getter : sGetters) {
-        if (getter.second->mDone)
-            continue;
-        const json11::Json val = value(jsons, getter.second->jsonKey());
-        if (!val.is_null() && !getter.second->apply(val)) {
-            usage(stderr);
-            fprintf(stderr, "Can't parse %s for %s\n", val.dump().c_str(), getter.second->jsonKey().c_str());
-            return false;
-        }
-        getter.second->mDone = true;
-    }
+    std::vector<std::string> paths;
+    if (const char *home = getenv("HOME"))
+        paths.push_back(std::string(home) + "/.config/fisk/client.conf");
+    paths.push_back("/etc/xdg/fisk/client.conf");
+    paths.push_back("/etc/xdg/fisk/client.conf.override");
 
-    const std::string dir = cacheDir;
-    std::string versionFile = dir + "version";
-    int fd = open(versionFile.c_str(), O_RDONLY|O_CLOEXEC);
-    if (fd != -1) {
-        flock(fd, LOCK_SH); // what if it fails?
-        uint32_t version;
-        if (read(fd, &version, sizeof(version)) == sizeof(version)) {
-            flock(fd, LOCK_UN); // what if it fails?
-            ::close(fd);
-            if (version == htonl(Version)) {
-                return true;
+    // The snapshot lives in the cache dir we have before reading the config
+    // files. If they set a different one it's in the snapshot.
+    std::string snapshotDir = cacheDir;
+    const std::string snapshot = snapshotDir.empty() ? std::string() : snapshotDir + "config";
+    std::vector<std::pair<std::string, std::string> > values;
+    const bool fromSnapshot = !snapshot.empty() && loadSnapshot(snapshot, paths, values);
+    if (fromSnapshot) {
+        for (const std::pair<std::string, std::string> &value : values) {
+            GetterBase *getter = sGetters[value.first];
+            if (!getter->mDone && !getter->apply(value.second)) {
+                fprintf(stderr, "Can't parse %s for %s in %s\n", value.second.c_str(), value.first.c_str(), snapshot.c_str());
+                return false;
             }
         }
-    }
-    Client::recursiveRmdir(dir);
-    Client::recursiveMkdir(dir);
+    } else {
+        std::vector<json11::Json> jsons;
+        auto load = [](const std::string &path, std::vector<json11::Json> &j) {
+            FILE *f = fopen(path.c_str(), "r");
+            if (!f)
+                return true;
+            fseek(f, 0, SEEK_END);
+            const long size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+            if (!size) {
+                fclose(f);
+                return false;
+            }
 
-    fd = open(versionFile.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
-    if (fd != -1) {
-        flock(fd, LOCK_EX); // what if it fails?
-        const uint32_t version = htonl(Version);
-        if (write(fd, &version, sizeof(version)) != sizeof(version)) {
-            ERROR("Failed to log");
+            std::string contents(size, ' ');
+            const size_t read = fread(&contents[0], 1, size, f);
+            fclose(f);
+            if (read != static_cast<size_t>(size)) {
+                fprintf(stderr, "Failed to read from file: %s (%d %s)\n", path.c_str(), errno, strerror(errno));
+                return false;
+            }
+
+            std::string err;
+            json11::Json parsed = json11::Json::parse(contents, err, json11::JsonParse::COMMENTS);
+            if (!err.empty()) {
+                fprintf(stderr, "Failed to parse json from %s: %s\n", path.c_str(), err.c_str());
+                return false;
+            }
+            j.push_back(std::move(parsed));
+            return true;
+        };
+        for (const std::string &path : paths) {
+            if (!load(path, jsons))
+                return false;
+        }
+        for (const auto &getter : sGetters) {
+            const json11::Json val = value(jsons, getter.second->jsonKey());
+            if (!val.is_null()) {
+                // what the command line or environment set wins but the
+                // snapshot is for runs without those so it has everything
+                if (!getter.second->mDone && !getter.second->apply(val)) {
+                    usage(stderr);
+                    fprintf(stderr, "Can't parse %s for %s\n", val.dump().c_str(), getter.second->jsonKey().c_str());
+                    return false;
+                }
+                values.emplace_back(getter.first, val.is_string() ? val.string_value()
+                                    : val.is_bool() ? (val.bool_value() ? "true" : "false")
+                                    : std::to_string(val.int_value()));
+            }
         }
-        flock(fd, LOCK_UN);
-        ::close(fd);
     }
+    for (const auto &getter : sGetters)
+        getter.second->mDone = true;
+
+    const std::string dir = cacheDir;
+    // The snapshot is written after the version check so if we found one in
+    // this dir it's been done already
+    if (!fromSnapshot || dir != snapshotDir)
+        checkVersion(dir);
+    if (!fromSnapshot && !snapshot.empty())
+        writeSnapshot(snapshot, paths, values);
+
+    // a getter read while the config was being loaded could have been
+    // derived from something that has been set since
+    for (const auto &getter : sGetters)
+        getter.second->invalidate();
     return true;
 }
 
@@ -332,7 +486,7 @@ void Config::usage(FILE *f)
             "Options:\n"
             "--------\n");
     int max = 0;
-    for (const std::pair<std::string, GetterBase *> &getter : sGetters) {
+    for (const auto &getter : sGetters) {
         max = std::max<int>(max, 2 + 7 + getter.first.size() + 1 + 8 + 3 + 3);
     }
     fprintf(f, "  --help%*s%s (false)\n", max - 12, "", "Display this help (if argv0 is fiskc)");
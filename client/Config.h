@@ -11,10 +11,12 @@
 #include <sstream>
 #include <limits>
 
+#include <atomic>
 #include <functional>
+#include <mutex>
 
 namespace Config {
-enum { Version = 5 };
+enum { Version = 6 };
 bool init(int &argc, char **&argv);
 void usage(FILE *f);
 
@@ -30,6 +32,8 @@ public:
     virtual bool apply(const json11::Json &input) = 0;
     virtual bool requiresArgument() const = 0;
     virtual std::string toString() const = 0;
+    // forgets the evaluated value, for when what it's derived from changed
+    virtual void invalidate() = 0;
     const char *help() const { return mHelp; }
 private:
     const char *mHelp;
@@ -48,6 +52,7 @@ public:
     virtual bool apply(const json11::Json &) { return false; }
     virtual bool requiresArgument() const { return false; }
     virtual std::string toString() const { return std::string(); }
+    virtual void invalidate() {}
 };
 
 template <typename T> T identity(const T &t) { return t; }
@@ -58,9 +63,22 @@ public:
     Getter(const char *arg, const char *help, const T &defaultValue = T(), const std::function<T(const T &)> &getter = identity<T>)
         : GetterBase(arg, help), mValue(defaultValue), mGetter(getter)
     {}
-    operator T() const { return mGetter(mValue); }
-    virtual bool apply(const std::string &input) override { return applyValue(input, mValue); }
-    virtual bool apply(const json11::Json &input) override { return applyJsonValue(input, mValue); }
+    // the getter runs the first time the value is read, after that it's a
+    // copy
+    operator T() const
+    {
+        if (!mCached.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mCached.load(std::memory_order_relaxed)) {
+                mCachedValue = mGetter(mValue);
+                mCached.store(true, std::memory_order_release);
+            }
+        }
+        return mCachedValue;
+    }
+    virtual bool apply(const std::string &input) override { invalidate(); return applyValue(input, mValue); }
+    virtual bool apply(const json11::Json &input) override { invalidate(); return applyJsonValue(input, mValue); }
+    virtual void invalidate() override { mCached.store(false, std::memory_order_release); }
     virtual bool requiresArgument() const override { return !std::is_same<T, bool>::value; }
     virtual std::string toString() const override
     {
@@ -176,6 +194,9 @@ private:
 
     T mValue;
     std::function<T(const T &)> mGetter;
+    mutable T mCachedValue;
+    mutable std::atomic<bool> mCached { false };
+    mutable std::mutex mMutex;
 };
 
 extern Getter<std::string> scheduler;
@@ -190,19 +211,76 @@ extern Getter<std::string> cacheDir;
 extern Getter<std::string> slave;
 extern Getter<bool> noDesire;
 extern Getter<bool> disabled;
+extern Getter<bool> speculate;
+extern Getter<bool> costModel;
 extern Getter<bool> help;
 inline std::string envCache()
 {
     std::string ret = cacheDir;
     if (!ret.empty()) {
         assert(ret[ret.size() - 1] == '/');
-        ret += "environment_cache.json";
+        ret += "environment_cache";
+    }
+    return ret;
+}
+inline std::string compilerCacheDir()
+{
+    std::string ret = cacheDir;
+    if (!ret.empty()) {
+        assert(ret[ret.size() - 1] == '/');
+        ret += "compilers/";
+    }
+    return ret;
+}
+extern Getter<bool> objectCache;
+extern Getter<bool> sharedObjectCache;
+extern Getter<size_t> objectCacheSize;
+inline std::string objectCacheDir()
+{
+    std::string ret = cacheDir;
+    if (!ret.empty()) {
+        assert(ret[ret.size() - 1] == '/');
+        ret += "objects/";
+    }
+    return ret;
+}
+extern Getter<bool> adaptiveTimeouts;
+inline std::string watchdogHistory()
+{
+    std::string ret = cacheDir;
+    if (!ret.empty()) {
+        assert(ret[ret.size() - 1] == '/');
+        ret += "watchdog_history";
+    }
+    return ret;
+}
+inline std::string costModelFile()
+{
+    std::string ret = cacheDir;
+    if (!ret.empty()) {
+        assert(ret[ret.size() - 1] == '/');
+        ret += "cost_model";
+    }
+    return ret;
+}
+extern Getter<bool> daemon;
+inline std::string daemonSocket()
+{
+    std::string ret = cacheDir;
+    if (!ret.empty()) {
+        assert(ret[ret.size() - 1] == '/');
+        ret += "daemon.sock";
     }
     return ret;
 }
 extern Getter<size_t> compileSlots;
 extern Getter<size_t> desiredCompileSlots;
 extern Getter<size_t> cppSlots;
+extern Getter<bool> adaptiveSlots;
+extern Getter<size_t> memoryBudget;
+extern Getter<bool> jobserver;
+extern Getter<std::string> priority;
+extern Getter<size_t> backgroundSlots;
 extern Getter<bool> watchdog;
 extern Getter<std::string> nodePath;
 extern Getter<std::string> hostname;
@@ -211,8 +289,12 @@ extern Getter<std::string> logFile;
 extern Getter<bool> logFileAppend;
 extern Getter<std::string> logLevel;
 extern Getter<bool> verbose;
+extern Getter<bool> profileStartup;
+extern Getter<std::string> traceFile;
 extern Getter<bool> discardComments;
+extern Getter<int> compressionLevel;
 extern Getter<bool> dumpSemaphores;
 extern Getter<bool> cleanSemaphores;
+extern Getter<std::string> slotsFile;
 }
 #endif /* CONFIG_H */
@@ -0,0 +1,124 @@
+#include "CostModel.h"
+#include "Config.h"
+#include "Client.h"
+#include "Log.h"
+#include <sys/file.h>
+#include <unistd.h>
+
+enum {
+    ModelMagic = 0x314d4346, // FCM1
+    MinSamples = 8,
+    // once warmed up each sample moves the averages by 1/Weight
+    Weight = 16,
+    // one in Explore jobs goes the default way so the path that keeps
+    // losing still gets samples when things change
+    Explore = 16
+};
+
+struct Model
+{
+    uint32_t magic;
+    uint32_t localSamples, remoteSamples;
+    double localRate; // bytes per ms
+    double uploadRate; // bytes per ms
+    double slaveRate; // bytes per ms
+    double overhead; // ms
+};
+
+static inline void average(double &value, double sample, uint32_t samples)
+{
+    value += (sample - value) / std::min<uint32_t>(samples, Weight);
+}
+
+static bool load(Model &model)
+{
+    const std::string path = Config::costModelFile();
+    if (path.empty())
+        return false;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    const bool ok = ::pread(fd, &model, sizeof(model), 0) == sizeof(model) && model.magic == ModelMagic;
+    ::close(fd);
+    return ok;
+}
+
+template <typename Functor>
+static void update(Functor &&functor)
+{
+    const std::string path = Config::costModelFile();
+    if (path.empty())
+        return;
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        DEBUG("Failed to open %s: %d %s", path.c_str(), errno, strerror(errno));
+        return;
+    }
+    if (::flock(fd, LOCK_EX)) {
+        ::close(fd);
+        return;
+    }
+    Model model;
+    if (::pread(fd, &model, sizeof(model), 0) != sizeof(model) || model.magic != ModelMagic) {
+        memset(&model, 0, sizeof(model));
+        model.magic = ModelMagic;
+    }
+    functor(model);
+    if (::pwrite(fd, &model, sizeof(model), 0) != sizeof(model))
+        ERROR("Failed to write %s: %d %s", path.c_str(), errno, strerror(errno));
+    ::close(fd); // releases the lock
+}
+
+CostModel::Choice CostModel::choose(size_t bytes)
+{
+    Model model;
+    if (!load(model) || model.localSamples < MinSamples || model.remoteSamples < MinSamples)
+        return Unknown;
+    if (model.localRate <= 0 || model.uploadRate <= 0 || model.slaveRate <= 0)
+        return Unknown;
+    if (getpid() % Explore == 0)
+        return Unknown;
+
+    const double local = bytes / model.localRate;
+    const double remote = model.overhead + bytes / model.uploadRate + bytes / model.slaveRate;
+    DEBUG("Cost model for %zu bytes: local %.1fms remote %.1fms (overhead %.1fms upload %.1f bytes/ms slave %.1f bytes/ms)",
+          bytes, local, remote, model.overhead, model.uploadRate, model.slaveRate);
+    return local <= remote ? Local : Remote;
+}
+
+CostModel::Choice CostModel::undersampled()
+{
+    Model model;
+    if (!load(model))
+        memset(&model, 0, sizeof(model));
+    if (model.localSamples < MinSamples)
+        return Local;
+    if (model.remoteSamples < MinSamples)
+        return Remote;
+    return Unknown;
+}
+
+void CostModel::addLocal(size_t bytes, unsigned long long duration)
+{
+    if (!Config::costModel || !bytes)
+        return;
+    update([bytes, duration](Model &model) {
+        average(model.localRate, static_cast<double>(bytes) / std::max(duration, 1ull), ++model.localSamples);
+    });
+}
+
+void CostModel::addRemote(size_t bytes, unsigned long long upload, unsigned long long total, double slaveSpeed)
+{
+    if (!Config::costModel || !bytes)
+        return;
+    update([=](Model &model) {
+        const uint32_t samples = ++model.remoteSamples;
+        average(model.uploadRate, static_cast<double>(bytes) / std::max(upload, 1ull), samples);
+        double speed = slaveSpeed;
+        if (speed <= 0) // old scheduler, count the whole wait for the response as compiling
+            speed = static_cast<double>(bytes) / std::max<unsigned long long>(total - std::min(total, upload), 1);
+        average(model.slaveRate, speed, samples);
+        // whatever isn't explained by the upload or the compile
+        average(model.overhead, std::max(0.0, total - upload - bytes / speed), samples);
+    });
+}
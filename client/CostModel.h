@@ -0,0 +1,32 @@
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <cstddef>
+
+// With --fisk-cost-model fiskc estimates how long a job would take locally
+// and remotely and picks the cheaper one. Local jobs are modeled as the
+// preprocessed size over the local compile throughput, remote jobs as a
+// fixed overhead (scheduler, connecting, queueing, downloading the result)
+// plus the time to upload the preprocessed output and the time the slaves
+// take to compile it. The rates are moving averages kept in the cache dir
+// and shared by all fiskc processes using it.
+namespace CostModel {
+enum Choice {
+    Unknown, // not enough samples
+    Local,
+    Remote
+};
+Choice choose(size_t bytes);
+// the side that doesn't have enough samples yet, local first, Unknown once
+// choose() has enough to go on
+Choice undersampled();
+// a local compile of bytes of preprocessed output that took duration ms
+void addLocal(size_t bytes, unsigned long long duration);
+// A remote job where upload is the ms it took to upload and total the ms
+// from asking the scheduler until we had the result. slaveSpeed is the
+// scheduler's average compile speed for the slave in bytes per ms, 0 if it
+// didn't send one.
+void addRemote(size_t bytes, unsigned long long upload, unsigned long long total, double slaveSpeed);
+}
+
+#endif /* COSTMODEL_H */
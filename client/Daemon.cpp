@@ -0,0 +1,454 @@
+#include "Daemon.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include "SchedulerWebSocket.h"
+#include "Select.h"
+#include "Watchdog.h"
+#include "WebSocket.h"
+#include <csignal>
+#include <json11.hpp>
+#include <memory>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool socketAddress(sockaddr_un &addr)
+{
+    const std::string path = Config::daemonSocket();
+    if (path.empty())
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        ERROR("Daemon socket path is too long: %s", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static bool setCloseOnExec(int fd)
+{
+    int r;
+    while ((r = fcntl(fd, F_SETFD, FD_CLOEXEC)) == -1 && errno == EINTR);
+    return r != -1;
+}
+
+namespace {
+class Server;
+
+class SchedulerConnection : public WebSocket
+{
+public:
+    SchedulerConnection(Server *server)
+        : mServer(server)
+    {}
+    virtual void onConected() override
+    {
+        DEBUG("Daemon connected to scheduler");
+    }
+    virtual void onMessage(MessageType type, const void *data, size_t len) override;
+private:
+    Server *mServer;
+};
+
+class Listener : public Socket
+{
+public:
+    Listener(int fd)
+        : mFD(fd)
+    {}
+    ~Listener()
+    {
+        ::close(mFD);
+    }
+
+    // Sockets can't be added to the Select while it's iterating so the
+    // server picks these up after each exec()
+    std::vector<int> accepted;
+protected:
+    virtual int fd() const override { return mFD; }
+    virtual unsigned int mode() const override { return Read; }
+    virtual void onWrite() override {}
+    virtual void onRead() override
+    {
+        while (true) {
+            const int fd = ::accept(mFD, 0, 0);
+            if (fd == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    ERROR("Failed to accept (%d %s)", errno, strerror(errno));
+                break;
+            }
+            if (!Client::setFlag(fd, O_NONBLOCK) || !setCloseOnExec(fd)) {
+                ::close(fd);
+                continue;
+            }
+            accepted.push_back(fd);
+        }
+    }
+    virtual void onTimeout() override {}
+    virtual int timeout() override { return -1; }
+private:
+    const int mFD;
+};
+
+// A fiskc invocation, requests and replies are single lines of JSON
+class Connection : public Socket
+{
+public:
+    Connection(Server *server, int fd)
+        : mServer(server), mFD(fd)
+    {}
+    ~Connection()
+    {
+        ::close(mFD);
+    }
+
+    void write(const json11::Json &msg)
+    {
+        mWriteBuffer += msg.dump();
+        mWriteBuffer += '\n';
+        onWrite();
+    }
+
+    bool closed { false };
+    bool answered { false };
+    unsigned int requestId { 0 }; // while the scheduler holds a request for us
+protected:
+    virtual int fd() const override { return mFD; }
+    virtual unsigned int mode() const override
+    {
+        if (closed)
+            return None;
+        return mWriteBuffer.empty() ? Read : Read|Write;
+    }
+    virtual void onRead() override;
+    virtual void onWrite() override
+    {
+        while (!closed && !mWriteBuffer.empty()) {
+            const ssize_t w = ::write(mFD, mWriteBuffer.c_str(), mWriteBuffer.size());
+            if (w > 0) {
+                mWriteBuffer.erase(0, w);
+            } else if (errno != EINTR) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    closed = true;
+                break;
+            }
+        }
+    }
+    virtual void onTimeout() override {}
+    virtual int timeout() override { return -1; }
+private:
+    Server *mServer;
+    const int mFD;
+    std::string mReadBuffer, mWriteBuffer;
+};
+
+class Server
+{
+public:
+    Server(int fd)
+        : mListener(fd)
+    {
+        mSelect.add(&mListener);
+    }
+
+    int exec();
+    void onRequest(Connection *connection, const json11::Json &msg);
+    void onSchedulerMessage(const json11::Json &msg);
+private:
+    void sendToScheduler(const json11::Json &msg);
+    void release(Connection *connection);
+    void failRequests();
+
+    Select mSelect;
+    Listener mListener;
+    std::unique_ptr<SchedulerConnection> mScheduler;
+    std::vector<std::unique_ptr<Connection>> mConnections;
+    std::map<unsigned int, Connection *> mRequests;
+    std::vector<std::string> mQueue; // sent once we're connected to the scheduler
+    unsigned int mNextRequestId { 0 };
+};
+
+void SchedulerConnection::onMessage(MessageType type, const void *data, size_t len)
+{
+    if (type != Text)
+        return;
+    std::string err;
+    const json11::Json msg = json11::Json::parse(std::string(reinterpret_cast<const char *>(data), len), err, json11::JsonParse::COMMENTS);
+    if (!err.empty()) {
+        ERROR("Failed to parse json from scheduler: %s", err.c_str());
+        return;
+    }
+    mServer->onSchedulerMessage(msg);
+}
+
+void Connection::onRead()
+{
+    while (!closed) {
+        char buf[BUFSIZ];
+        const ssize_t r = ::read(mFD, buf, sizeof(buf));
+        if (r > 0) {
+            mReadBuffer.append(buf, r);
+        } else if (!r) {
+            closed = true;
+        } else if (errno != EINTR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                closed = true;
+            break;
+        }
+    }
+    size_t newline;
+    while (!closed && (newline = mReadBuffer.find('\n')) != std::string::npos) {
+        std::string err;
+        const json11::Json msg = json11::Json::parse(mReadBuffer.substr(0, newline), err, json11::JsonParse::COMMENTS);
+        mReadBuffer.erase(0, newline + 1);
+        if (!err.empty()) {
+            ERROR("Failed to parse json from fiskc: %s", err.c_str());
+            closed = true;
+            break;
+        }
+        mServer->onRequest(this, msg);
+    }
+}
+
+int Server::exec()
+{
+    while (true) {
+        mSelect.exec();
+        for (int fd : mListener.accepted) {
+            mConnections.emplace_back(new Connection(this, fd));
+            mSelect.add(mConnections.back().get());
+        }
+        mListener.accepted.clear();
+
+        if (mScheduler) {
+            const WebSocket::State state = mScheduler->state();
+            if (state == WebSocket::ConnectedWebSocket) {
+                for (const std::string &msg : mQueue)
+                    mScheduler->send(WebSocket::Text, msg.c_str(), msg.size());
+                mQueue.clear();
+            } else if (state == WebSocket::Error || state == WebSocket::Closed) {
+                ERROR("Daemon lost connection to scheduler");
+                mSelect.remove(mScheduler.get());
+                mScheduler.reset();
+                mQueue.clear();
+                failRequests();
+            }
+        }
+
+        for (auto it = mConnections.begin(); it != mConnections.end(); ) {
+            if ((*it)->closed) {
+                release(it->get());
+                mSelect.remove(it->get());
+                it = mConnections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return 0;
+}
+
+void Server::onRequest(Connection *connection, const json11::Json &msg)
+{
+    if (connection->requestId || connection->answered) {
+        ERROR("Got more than one request from fiskc");
+        connection->closed = true;
+        return;
+    }
+    if (!++mNextRequestId)
+        ++mNextRequestId;
+    connection->requestId = mNextRequestId;
+    mRequests[mNextRequestId] = connection;
+    DEBUG("Requesting slave %u for %s", mNextRequestId, msg["headers"]["x-fisk-sourcefile"].string_value().c_str());
+    sendToScheduler(json11::Json::object {
+            { "type", "requestSlave" },
+            { "requestId", static_cast<int>(mNextRequestId) },
+            { "headers", msg["headers"] }
+        });
+}
+
+void Server::onSchedulerMessage(const json11::Json &msg)
+{
+    const unsigned int requestId = msg["requestId"].int_value();
+    auto it = mRequests.find(requestId);
+    if (it == mRequests.end()) {
+        DEBUG("Got reply for unknown request %u", requestId);
+        return;
+    }
+    Connection *connection = it->second;
+    json11::Json::object reply = msg.object_items();
+    reply.erase("requestId");
+    if (msg["type"].string_value() != "slave" || !msg["port"].int_value()) {
+        // nothing for us to hold on to, the client will go to the scheduler
+        // itself to upload an environment or build locally
+        release(connection);
+    }
+    connection->answered = true;
+    connection->write(reply);
+}
+
+void Server::sendToScheduler(const json11::Json &msg)
+{
+    if (!mScheduler) {
+        std::map<std::string, std::string> headers;
+        headers["x-fisk-client-name"] = Config::name;
+        headers["x-fisk-config-version"] = std::to_string(Config::Version);
+        std::string hostname = Config::hostname;
+        if (!hostname.empty())
+            headers["x-fisk-client-hostname"] = std::move(hostname);
+        mScheduler.reset(new SchedulerConnection(this));
+        if (!mScheduler->connect(Client::schedulerUrl() + "/daemon", headers)) {
+            ERROR("Daemon failed to connect to scheduler");
+            mScheduler.reset();
+            failRequests();
+            return;
+        }
+        mSelect.add(mScheduler.get());
+    }
+    const std::string str = msg.dump();
+    if (mScheduler->state() == WebSocket::ConnectedWebSocket) {
+        mScheduler->send(WebSocket::Text, str.c_str(), str.size());
+    } else {
+        mQueue.push_back(str);
+    }
+}
+
+void Server::release(Connection *connection)
+{
+    if (!connection->requestId)
+        return;
+    if (mScheduler && mScheduler->state() == WebSocket::ConnectedWebSocket) {
+        const std::string str = json11::Json(json11::Json::object {
+                { "type", "release" },
+                { "requestId", static_cast<int>(connection->requestId) }
+            }).dump();
+        mScheduler->send(WebSocket::Text, str.c_str(), str.size());
+    }
+    mRequests.erase(connection->requestId);
+    connection->requestId = 0;
+}
+
+void Server::failRequests()
+{
+    // the scheduler forgets about all of our requests when the connection
+    // goes away so the ones that already have a slave are on their own
+    for (const std::pair<const unsigned int, Connection *> &request : mRequests) {
+        request.second->requestId = 0;
+        if (!request.second->answered) {
+            request.second->answered = true;
+            request.second->write(json11::Json::object { { "type", "error" } });
+        }
+    }
+    mRequests.clear();
+}
+}
+
+int Daemon::exec()
+{
+    sockaddr_un addr;
+    if (!socketAddress(addr)) {
+        ERROR("No socket path for daemon");
+        return 1;
+    }
+    std::string dir;
+    Client::parsePath(addr.sun_path, 0, &dir);
+    if (!Client::recursiveMkdir(dir)) {
+        ERROR("Failed to create directory %s (%d %s)", dir.c_str(), errno, strerror(errno));
+        return 1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        ERROR("Failed to create socket (%d %s)", errno, strerror(errno));
+        return 1;
+    }
+    unlink(addr.sun_path);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(fd, 128)) {
+        ERROR("Failed to listen on %s (%d %s)", addr.sun_path, errno, strerror(errno));
+        ::close(fd);
+        return 1;
+    }
+    chmod(addr.sun_path, S_IRUSR|S_IWUSR);
+    if (!Client::setFlag(fd, O_NONBLOCK) || !setCloseOnExec(fd)) {
+        ::close(fd);
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    DEBUG("Daemon listening on %s", addr.sun_path);
+    Server server(fd);
+    return server.exec();
+}
+
+bool Daemon::requestSlave(const std::map<std::string, std::string> &headers, SchedulerWebSocket &schedulerWebSocket)
+{
+    sockaddr_un addr;
+    if (!socketAddress(addr))
+        return false;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+    setCloseOnExec(fd);
+    int ret;
+    while ((ret = ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) == -1 && errno == EINTR);
+    if (ret) {
+        DEBUG("No daemon at %s (%d %s)", addr.sun_path, errno, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    std::string request = json11::Json(json11::Json::object { { "headers", json11::Json(headers) } }).dump();
+    request += '\n';
+    size_t written = 0;
+    while (written < request.size()) {
+        const ssize_t w = ::write(fd, request.c_str() + written, request.size() - written);
+        if (w > 0) {
+            written += w;
+        } else if (errno != EINTR) {
+            DEBUG("Failed to write to daemon (%d %s)", errno, strerror(errno));
+            ::close(fd);
+            return false;
+        }
+    }
+
+    std::string reply;
+    const unsigned long long deadline = Client::mono() + Config::schedulerConnectTimeout + Config::acquiredSlaveTimeout;
+    while (reply.empty() || reply[reply.size() - 1] != '\n') {
+        const unsigned long long now = Client::mono();
+        pollfd p = { fd, POLLIN, 0 };
+        const int polled = now < deadline ? poll(&p, 1, deadline - now) : 0;
+        if (polled == -1 && errno == EINTR)
+            continue;
+        if (polled <= 0) {
+            DEBUG("Timed out waiting for daemon");
+            ::close(fd);
+            return false;
+        }
+        char buf[BUFSIZ];
+        const ssize_t r = ::read(fd, buf, sizeof(buf));
+        if (r <= 0) {
+            if (r == -1 && errno == EINTR)
+                continue;
+            DEBUG("Daemon closed the connection");
+            ::close(fd);
+            return false;
+        }
+        reply.append(buf, r);
+    }
+
+    std::string err;
+    const json11::Json msg = json11::Json::parse(reply, err, json11::JsonParse::COMMENTS);
+    if (!err.empty() || msg["type"].string_value() != "slave" || !msg["port"].int_value()) {
+        DEBUG("Daemon couldn't give us a slave: %s", reply.c_str());
+        ::close(fd);
+        return false;
+    }
+    // fd stays open until we exit so the scheduler knows the slave is busy
+    Client::data().watchdog->transition(Watchdog::ConnectedToScheduler);
+    schedulerWebSocket.onSlave(msg);
+    return true;
+}
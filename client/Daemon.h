@@ -0,0 +1,22 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <map>
+#include <string>
+
+class SchedulerWebSocket;
+
+// fiskc --fisk-daemon keeps a single WebSocket to the scheduler open and
+// hands out slaves to fiskc invocations over a unix socket in the cache
+// dir. An invocation keeps its connection to the daemon open for as long as
+// it's using the slave, closing it lets the scheduler know we're done.
+namespace Daemon {
+int exec();
+
+// Fills in the slave of schedulerWebSocket. Returns false if there's no
+// daemon or it couldn't give us a slave, in which case we'll have to talk
+// to the scheduler ourselves.
+bool requestSlave(const std::map<std::string, std::string> &headers, SchedulerWebSocket &schedulerWebSocket);
+}
+
+#endif /* DAEMON_H */
@@ -0,0 +1,129 @@
+#include "Jobserver.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+
+static int sRead = -1, sWrite = -1;
+static bool sLent = false;
+static char sToken = '+';
+
+// MAKEFLAGS has --jobserver-auth=fifo:PATH (make 4.4), --jobserver-auth=R,W
+// or, before make 4.2, --jobserver-fds=R,W. The last one is the one that
+// counts.
+static bool init()
+{
+    static bool initialized = false;
+    if (initialized)
+        return sRead != -1;
+    initialized = true;
+    const char *makeflags = getenv("MAKEFLAGS");
+    if (!makeflags || !Config::jobserver)
+        return false;
+    std::string auth;
+    const char *flag = makeflags;
+    while ((flag = strstr(flag, "--jobserver-"))) {
+        flag += 12;
+        const char *value = nullptr;
+        if (!strncmp(flag, "auth=", 5)) {
+            value = flag + 5;
+        } else if (!strncmp(flag, "fds=", 4)) {
+            value = flag + 4;
+        }
+        if (value)
+            auth.assign(value, strcspn(value, " "));
+    }
+    if (auth.empty())
+        return false;
+
+    int readFd = -1, writeFd = -1;
+    if (!strncmp(auth.c_str(), "fifo:", 5)) {
+        readFd = writeFd = ::open(auth.c_str() + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    } else {
+        int r, w;
+        if (sscanf(auth.c_str(), "%d,%d", &r, &w) != 2)
+            return false;
+        // make doesn't pass the fds to recipes it doesn't consider
+        // recursive, don't write to whatever has those numbers then
+        struct stat st;
+        if (fstat(r, &st) || !S_ISFIFO(st.st_mode) || fstat(w, &st) || !S_ISFIFO(st.st_mode)) {
+            DEBUG("Jobserver fds %d,%d aren't pipes", r, w);
+            return false;
+        }
+#ifdef __linux__
+        // our own open file description so O_NONBLOCK doesn't leak into make
+        readFd = ::open(Client::format("/proc/self/fd/%d", r).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#else
+        readFd = r;
+#endif
+        writeFd = w;
+    }
+    if (readFd == -1) {
+        DEBUG("Failed to open jobserver %s: %d %s", auth.c_str(), errno, strerror(errno));
+        return false;
+    }
+    DEBUG("Using jobserver %s", auth.c_str());
+    sRead = readFd;
+    sWrite = writeFd;
+    return true;
+}
+
+bool Jobserver::lend()
+{
+    if (sLent || !init())
+        return false;
+    ssize_t w;
+    while ((w = ::write(sWrite, &sToken, 1)) == -1 && errno == EINTR);
+    if (w != 1) {
+        DEBUG("Failed to return jobserver token: %d %s", errno, strerror(errno));
+        return false;
+    }
+    DEBUG("Lent our jobserver token");
+    sLent = true;
+    return true;
+}
+
+static bool take(bool wait)
+{
+    while (true) {
+        pollfd fd = { sRead, POLLIN, 0 };
+        const int p = ::poll(&fd, 1, wait ? -1 : 0);
+        if (p == -1 && errno == EINTR)
+            continue;
+        if (!p)
+            return false;
+        const ssize_t r = ::read(sRead, &sToken, 1);
+        if (r == 1) {
+            sLent = false;
+            DEBUG("Got a jobserver token back");
+            return true;
+        }
+        if (r == -1 && (errno == EINTR || errno == EAGAIN)) {
+            // someone else got it
+            if (!wait && errno == EAGAIN)
+                return false;
+            continue;
+        }
+        // the build tool went away, there's no one to give it back to
+        sLent = false;
+        return true;
+    }
+}
+
+void Jobserver::acquire()
+{
+    if (sLent)
+        take(true);
+}
+
+bool Jobserver::tryAcquire()
+{
+    return !sLent || take(false);
+}
+
+bool Jobserver::isLent()
+{
+    return sLent;
+}
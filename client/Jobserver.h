@@ -0,0 +1,22 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+// When fiskc runs under a GNU make (or ninja) jobserver it's a job that
+// holds a token. While a job is compiled remotely the token is written
+// back to the jobserver so the build tool can start something else, and
+// before anything is compiled locally it has to be read back again. That
+// way the build tool's -j is what's running on this machine, not the
+// number of fiskc processes. The token is always taken back before we
+// exit so the jobserver ends up with as many as it started with.
+namespace Jobserver {
+// gives our token back, false if there's no jobserver or we don't have it
+bool lend();
+// takes a token if we lent ours, blocks until one is available
+void acquire();
+// the same but doesn't block, false if there's no token to be had
+bool tryAcquire();
+// whether our token is lent out
+bool isLent();
+}
+
+#endif /* JOBSERVER_H */
@@ -0,0 +1,99 @@
+#include "Mask.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FISK_MASK_X86
+#endif
+
+// Repeats the mask, starting at offset, over size bytes so whole words
+// can be xored without caring where in the mask they start
+static inline void pattern(unsigned char *out, size_t size, const unsigned char mask[4], size_t offset)
+{
+    for (size_t i=0; i<size; ++i)
+        out[i] = mask[(offset + i) & 3];
+}
+
+static inline void tail(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char *pat)
+{
+    for (size_t i=0; i<len; ++i)
+        dst[i] = src[i] ^ pat[i & 7];
+}
+
+void Mask::applyScalar(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset)
+{
+    unsigned char pat[8];
+    pattern(pat, sizeof(pat), mask, offset);
+    uint64_t word;
+    memcpy(&word, pat, sizeof(word));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t data;
+        memcpy(&data, src + i, sizeof(data));
+        data ^= word;
+        memcpy(dst + i, &data, sizeof(data));
+    }
+    tail(dst + i, src + i, len - i, pat);
+}
+
+#ifdef FISK_MASK_X86
+__attribute__((target("sse2")))
+static void applySSE2(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset)
+{
+    unsigned char pat[16];
+    pattern(pat, sizeof(pat), mask, offset);
+    const __m128i word = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pat));
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        for (size_t j=0; j<64; j += 16) {
+            const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + j));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + j), _mm_xor_si128(data, word));
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(data, word));
+    }
+    tail(dst + i, src + i, len - i, pat);
+}
+
+__attribute__((target("avx2")))
+static void applyAVX2(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset)
+{
+    unsigned char pat[32];
+    pattern(pat, sizeof(pat), mask, offset);
+    const __m256i word = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pat));
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        for (size_t j=0; j<128; j += 32) {
+            const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + j));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + j), _mm256_xor_si256(data, word));
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        const __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(data, word));
+    }
+    tail(dst + i, src + i, len - i, pat);
+}
+#endif
+
+void Mask::apply(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset)
+{
+#ifdef FISK_MASK_X86
+    typedef void (*Function)(unsigned char *, const unsigned char *, size_t, const unsigned char *, size_t);
+    static const Function function = []() -> Function {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return applyAVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return applySSE2;
+        return Mask::applyScalar;
+    }();
+    if (len >= 256) {
+        function(dst, src, len, mask, offset);
+        return;
+    }
+#endif
+    applyScalar(dst, src, len, mask, offset);
+}
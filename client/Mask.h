@@ -0,0 +1,16 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stddef.h>
+
+// RFC 6455 masking of client frames. Handles any alignment and length,
+// dst may be the same as src. offset is the index into mask that the first
+// byte lines up with.
+namespace Mask {
+void apply(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset = 0);
+
+// The portable version, apply() picks SSE2/AVX2 when it can
+void applyScalar(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset = 0);
+}
+
+#endif /* MASK_H */
@@ -0,0 +1,539 @@
+#include "ObjectCache.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+    EntryMagic = 0x31434f46, // "FOC1"
+    ManifestMagic = 0x314d4f46 // "FOM1"
+};
+
+static std::string entryPath(const std::string &key)
+{
+    return Config::objectCacheDir() + key.substr(0, 2) + '/' + key.substr(2);
+}
+
+static bool readAll(int fd, std::string &contents)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return false;
+    contents.resize(st.st_size);
+    size_t offset = 0;
+    while (offset < contents.size()) {
+        const ssize_t r = ::read(fd, &contents[offset], contents.size() - offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        offset += r;
+    }
+    return true;
+}
+
+// Nobody ever sees a partially written file
+static bool writeFileAtomically(const std::string &path, const std::string &contents)
+{
+    Client::OutputFile file;
+    return file.open(path, contents.size()) && file.write(contents.c_str(), contents.size()) && file.commit();
+}
+
+template <typename T>
+static void appendInt(std::string &out, T value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool readInt(const std::string &in, size_t &offset, T &value)
+{
+    if (offset + sizeof(value) > in.size())
+        return false;
+    memcpy(&value, &in[offset], sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+static void appendString(std::string &out, const std::string &str)
+{
+    appendInt<uint64_t>(out, str.size());
+    out += str;
+}
+
+static bool readString(const std::string &in, size_t &offset, std::string &str)
+{
+    uint64_t size;
+    if (!readInt(in, offset, size) || size > in.size() - offset)
+        return false;
+    str.assign(in, offset, size);
+    offset += size;
+    return true;
+}
+
+static void appendFiles(std::string &out, const std::vector<ObjectCache::Entry::File> &files)
+{
+    for (const ObjectCache::Entry::File &file : files) {
+        appendString(out, file.path);
+        appendString(out, file.contents);
+    }
+}
+
+static bool readFiles(const std::string &in, size_t &offset, uint32_t count, std::vector<ObjectCache::Entry::File> &files)
+{
+    files.resize(count);
+    for (ObjectCache::Entry::File &file : files) {
+        if (!readString(in, offset, file.path) || !readString(in, offset, file.contents))
+            return false;
+    }
+    return true;
+}
+
+// Reads path and returns the sha1 of its contents. Files that expand
+// __DATE__, __TIME__ or __TIMESTAMP__ can't be cached without
+// preprocessing so those count as failures.
+static bool hashFile(const std::string &path, std::string &hash, struct stat *st = 0)
+{
+    const int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG("Failed to open %s for reading (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    std::string contents;
+    const bool ok = readAll(fd, contents) && (!st || !fstat(fd, st));
+    ::close(fd);
+    if (!ok) {
+        DEBUG("Failed to read %s (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    for (const char *macro : { "__DATE__", "__TIME__", "__TIMESTAMP__" }) {
+        if (contents.find(macro) != std::string::npos) {
+            DEBUG("%s uses %s", path.c_str(), macro);
+            return false;
+        }
+    }
+    hash = Client::sha1(contents);
+    return true;
+}
+
+struct CacheFile {
+    int64_t mtime;
+    off_t size;
+    std::string path;
+    bool operator<(const CacheFile &other) const { return mtime < other.mtime; }
+};
+
+// Removes the least recently used entries until the cache is at most
+// target bytes. Returns the new size of the cache.
+static uint64_t evict(uint64_t target)
+{
+    const std::string root = Config::objectCacheDir();
+    std::vector<CacheFile> files;
+    uint64_t total = 0;
+    DIR *dir = opendir(root.c_str());
+    if (!dir)
+        return 0;
+    while (dirent *d = readdir(dir)) {
+        if (strlen(d->d_name) != 2 || d->d_name[0] == '.')
+            continue;
+        const std::string subdir = root + d->d_name + '/';
+        DIR *sub = opendir(subdir.c_str());
+        if (!sub)
+            continue;
+        while (dirent *e = readdir(sub)) {
+            if (e->d_name[0] == '.')
+                continue;
+            CacheFile file;
+            file.path = subdir + e->d_name;
+            struct stat st;
+            if (stat(file.path.c_str(), &st) || !S_ISREG(st.st_mode))
+                continue;
+            file.mtime = Client::mtime(st);
+            file.size = st.st_size;
+            total += st.st_size;
+            files.push_back(std::move(file));
+        }
+        closedir(sub);
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    size_t removed = 0;
+    for (const CacheFile &file : files) {
+        if (total <= target)
+            break;
+        if (!unlink(file.path.c_str())) {
+            total -= file.size;
+            ++removed;
+        }
+    }
+    DEBUG("Evicted %zu/%zu object cache entries, %llu bytes left", removed, files.size(), static_cast<unsigned long long>(total));
+    return total;
+}
+
+static void addToSize(uint64_t bytes)
+{
+    const std::string path = Config::objectCacheDir() + "size";
+    const int fd = open(path.c_str(), O_CREAT|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd == -1) {
+        ERROR("Failed to open %s (%d %s)", path.c_str(), errno, strerror(errno));
+        return;
+    }
+    if (flock(fd, LOCK_EX)) {
+        ERROR("Failed to flock %s (%d %s)", path.c_str(), errno, strerror(errno));
+        ::close(fd);
+        return;
+    }
+    uint64_t size;
+    if (pread(fd, &size, sizeof(size), 0) != sizeof(size))
+        size = 0;
+    size += bytes;
+    const uint64_t limit = static_cast<uint64_t>(Config::objectCacheSize) * 1024 * 1024;
+    if (size > limit)
+        size = evict(limit - (limit / 10));
+    if (pwrite(fd, &size, sizeof(size), 0) != sizeof(size))
+        ERROR("Failed to write to %s (%d %s)", path.c_str(), errno, strerror(errno));
+    flock(fd, LOCK_UN);
+    ::close(fd);
+}
+
+static bool readRecord(const std::string &key, std::string &contents)
+{
+    const std::string path = entryPath(key);
+    const int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG("Object cache miss for %s", key.c_str());
+        return false;
+    }
+    const bool ok = readAll(fd, contents);
+    futimens(fd, 0); // mark as recently used
+    ::close(fd);
+    if (!ok)
+        ERROR("Failed to read %s (%d %s)", path.c_str(), errno, strerror(errno));
+    return ok;
+}
+
+static bool writeRecord(const std::string &key, const std::string &contents)
+{
+    const std::string path = entryPath(key);
+    std::string dir;
+    Client::parsePath(path, 0, &dir);
+    if (!Client::recursiveMkdir(dir)) {
+        ERROR("Failed to create directory %s (%d %s)", dir.c_str(), errno, strerror(errno));
+        return false;
+    }
+    if (!writeFileAtomically(path, contents))
+        return false;
+    DEBUG("Stored %zu bytes in object cache for %s", contents.size(), key.c_str());
+    addToSize(contents.size());
+    return true;
+}
+
+bool ObjectCache::addFile(std::vector<Entry::File> &files, const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        ERROR("Failed to open %s for reading (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    Entry::File file;
+    file.path = path;
+    const bool ok = readAll(fd, file.contents);
+    ::close(fd);
+    if (!ok) {
+        ERROR("Failed to read %s (%d %s)", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    files.push_back(std::move(file));
+    return true;
+}
+
+std::string ObjectCache::key(const std::string &environmentHash, const std::vector<std::string> &commandLine, const std::string &preprocessedHash)
+{
+    // Options that only matter to the preprocessor are covered by the hash
+    // of its output. argv[0] is covered by the environment hash.
+    static const char *separate[] = {
+        "-D", "-I", "-U", "-idirafter", "-imacros", "-include", "-iprefix",
+        "-iquote", "-isystem", "-iwithprefix", "-iwithprefixbefore"
+    };
+    static const char *joined[] = { "-D", "-I", "-U", "-idirafter", "-iquote", "-isystem" };
+    std::string data = environmentHash;
+    data += '\0';
+    for (size_t i=1; i<commandLine.size(); ++i) {
+        const std::string &arg = commandLine[i];
+        if (std::find_if(std::begin(separate), std::end(separate), [&arg](const char *opt) { return arg == opt; }) != std::end(separate)) {
+            ++i;
+            continue;
+        }
+        if (std::find_if(std::begin(joined), std::end(joined), [&arg](const char *opt) { return !arg.compare(0, strlen(opt), opt); }) != std::end(joined))
+            continue;
+        data += arg;
+        data += '\0';
+    }
+    data += preprocessedHash;
+    return Client::toHex(Client::sha1(data));
+}
+
+bool ObjectCache::load(const std::string &key, Entry &entry)
+{
+    std::string contents;
+    if (!readRecord(key, contents))
+        return false;
+
+    size_t offset = 0;
+    uint32_t magic, exitCode, fileCount;
+    bool valid = (readInt(contents, offset, magic) && magic == EntryMagic
+                  && readInt(contents, offset, exitCode)
+                  && readInt(contents, offset, fileCount)
+                  && readString(contents, offset, entry.stdOut)
+                  && readString(contents, offset, entry.stdErr)
+                  && readFiles(contents, offset, fileCount, entry.files));
+    if (!valid || offset != contents.size()) {
+        ERROR("Corrupted object cache entry %s", entryPath(key).c_str());
+        return false;
+    }
+    entry.exitCode = static_cast<int32_t>(exitCode);
+    DEBUG("Object cache hit for %s", key.c_str());
+    return true;
+}
+
+bool ObjectCache::store(const std::string &key, const Entry &entry)
+{
+    std::string contents;
+    appendInt<uint32_t>(contents, EntryMagic);
+    appendInt<uint32_t>(contents, entry.exitCode);
+    appendInt<uint32_t>(contents, entry.files.size());
+    appendString(contents, entry.stdOut);
+    appendString(contents, entry.stdErr);
+    appendFiles(contents, entry.files);
+    return writeRecord(key, contents);
+}
+
+bool ObjectCache::materialize(const Entry &entry)
+{
+    for (const Entry::File &file : entry.files) {
+        if (!writeFileAtomically(file.path, file.contents))
+            return false;
+    }
+    if (!entry.stdOut.empty())
+        fwrite(entry.stdOut.c_str(), 1, entry.stdOut.size(), stdout);
+    if (!entry.stdErr.empty())
+        fwrite(entry.stdErr.c_str(), 1, entry.stdErr.size(), stderr);
+    return true;
+}
+
+std::string ObjectCache::directKey(const std::string &environmentHash, const std::vector<std::string> &commandLine, const std::string &sourceFile)
+{
+    std::string sourceHash;
+    if (!hashFile(sourceFile, sourceHash))
+        return std::string();
+    // unlike key() every option matters here and relative include paths
+    // depend on the working directory
+    std::string data = "manifest";
+    data += '\0';
+    data += environmentHash;
+    data += '\0';
+    data += Client::realpath(".");
+    data += '\0';
+    for (size_t i=1; i<commandLine.size(); ++i) {
+        data += commandLine[i];
+        data += '\0';
+    }
+    data += sourceHash;
+    return Client::toHex(Client::sha1(data));
+}
+
+bool ObjectCache::addHeaders(Manifest &manifest, const std::set<std::string> &paths, time_t started)
+{
+    for (const std::string &path : paths) {
+        Manifest::Header header;
+        header.path = path;
+        struct stat st;
+        if (!hashFile(path, header.hash, &st))
+            return false;
+        if (st.st_mtime >= started) {
+            // might have been modified while we were preprocessing
+            DEBUG("%s is too new for the manifest", path.c_str());
+            return false;
+        }
+        header.size = st.st_size;
+        header.mtime = Client::mtime(st);
+        manifest.headers.push_back(std::move(header));
+    }
+    return true;
+}
+
+bool ObjectCache::lookup(const std::string &directKey, Manifest &manifest, Entry &entry)
+{
+    std::string contents;
+    if (!readRecord(directKey, contents))
+        return false;
+
+    size_t offset = 0;
+    uint32_t magic, headerCount, fileCount;
+    bool valid = (readInt(contents, offset, magic) && magic == ManifestMagic
+                  && readInt(contents, offset, headerCount)
+                  && readInt(contents, offset, fileCount)
+                  && readString(contents, offset, manifest.resultKey)
+                  && readString(contents, offset, manifest.cppStdErr));
+    if (valid) {
+        manifest.headers.resize(headerCount);
+        for (Manifest::Header &header : manifest.headers) {
+            if (!(valid = (readString(contents, offset, header.path)
+                           && readInt(contents, offset, header.size)
+                           && readInt(contents, offset, header.mtime)
+                           && readString(contents, offset, header.hash)))) {
+                break;
+            }
+        }
+    }
+    if (!valid || !readFiles(contents, offset, fileCount, manifest.files) || offset != contents.size()) {
+        ERROR("Corrupted object cache manifest %s", entryPath(directKey).c_str());
+        return false;
+    }
+
+    for (const Manifest::Header &header : manifest.headers) {
+        struct stat st;
+        if (stat(header.path.c_str(), &st) || static_cast<uint64_t>(st.st_size) != header.size) {
+            DEBUG("Manifest mismatch for %s", header.path.c_str());
+            return false;
+        }
+        if (Client::mtime(st) == header.mtime)
+            continue;
+        std::string hash;
+        if (!hashFile(header.path, hash) || hash != header.hash) {
+            DEBUG("Manifest mismatch for %s", header.path.c_str());
+            return false;
+        }
+    }
+    return load(manifest.resultKey, entry);
+}
+
+bool ObjectCache::storeManifest(const std::string &directKey, const Manifest &manifest)
+{
+    std::string contents;
+    appendInt<uint32_t>(contents, ManifestMagic);
+    appendInt<uint32_t>(contents, manifest.headers.size());
+    appendInt<uint32_t>(contents, manifest.files.size());
+    appendString(contents, manifest.resultKey);
+    appendString(contents, manifest.cppStdErr);
+    for (const Manifest::Header &header : manifest.headers) {
+        appendString(contents, header.path);
+        appendInt(contents, header.size);
+        appendInt(contents, header.mtime);
+        appendString(contents, header.hash);
+    }
+    appendFiles(contents, manifest.files);
+    return writeRecord(directKey, contents);
+}
+
+static void parseLinemarker(const std::string &line, std::set<std::string> &paths)
+{
+    // # 1 "foo.h" 2 or #line 1 "foo.h"
+    size_t i = 1;
+    if (!line.compare(i, 4, "line"))
+        i += 4;
+    while (i < line.size() && line[i] == ' ')
+        ++i;
+    if (i == line.size() || !isdigit(line[i]))
+        return;
+    while (i < line.size() && isdigit(line[i]))
+        ++i;
+    while (i < line.size() && line[i] == ' ')
+        ++i;
+    if (i == line.size() || line[i++] != '"')
+        return;
+    std::string path;
+    while (i < line.size() && line[i] != '"') {
+        if (line[i] == '\\' && i + 1 < line.size())
+            ++i;
+        path += line[i++];
+    }
+    if (i < line.size() && !path.empty() && path[0] != '<') // <built-in>, <command-line>
+        paths.insert(std::move(path));
+}
+
+void ObjectCache::includedFiles(Client::Preprocessed *preprocessed, std::set<std::string> &paths)
+{
+    std::string line; // a linemarker that might span chunks
+    bool inLine = false, atLineStart = true;
+    const char *data;
+    size_t size;
+    for (size_t idx=0; preprocessed->chunk(idx, data, size); ++idx) {
+        const char *p = data;
+        const char *end = data + size;
+        while (p < end) {
+            if (!inLine && atLineStart && *p == '#')
+                inLine = true;
+            const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+            if (inLine)
+                line.append(p, nl ? nl : end);
+            if (!nl) {
+                atLineStart = false;
+                break;
+            }
+            if (inLine) {
+                parseLinemarker(line, paths);
+                line.clear();
+                inLine = false;
+            }
+            atLineStart = true;
+            p = nl + 1;
+        }
+    }
+    if (inLine)
+        parseLinemarker(line, paths);
+}
+
+void ObjectCache::parseDepFile(const std::string &contents, std::set<std::string> &paths)
+{
+    // targets followed by a colon and the prerequisites, lines can be
+    // continued with a backslash and spaces in paths are escaped
+    std::string path;
+    bool target = true;
+    auto flush = [&]() {
+        if (path.empty())
+            return;
+        if (target) {
+            if (path[path.size() - 1] == ':')
+                target = false;
+        } else {
+            paths.insert(path);
+        }
+        path.clear();
+    };
+    for (size_t i=0; i<contents.size(); ++i) {
+        const char ch = contents[i];
+        if (ch == '\\' && i + 1 < contents.size()) {
+            const char next = contents[i + 1];
+            if (next == ' ' || next == '#' || next == '\\') {
+                path += next;
+                ++i;
+                continue;
+            }
+            if (next == '\n') {
+                ++i;
+                flush();
+                continue;
+            }
+        }
+        if (isspace(static_cast<unsigned char>(ch))) {
+            flush();
+            if (ch == '\n')
+                target = true;
+        } else if (ch == ':' && target && (i + 1 == contents.size() || isspace(static_cast<unsigned char>(contents[i + 1])))) {
+            path += ch;
+            flush();
+        } else {
+            path += ch;
+        }
+    }
+    flush();
+}
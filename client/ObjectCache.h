@@ -0,0 +1,68 @@
+#ifndef OBJECTCACHE_H
+#define OBJECTCACHE_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace Client {
+class Preprocessed;
+}
+
+// Content addressed cache of compile results in Config::objectCacheDir(),
+// one file per entry. Entries are written to a temporary file and renamed
+// into place so readers never take locks. A hit bumps the entry's mtime and
+// eviction removes the oldest entries once the cache grows past
+// Config::objectCacheSize.
+namespace ObjectCache {
+struct Entry
+{
+    struct File {
+        std::string path, contents;
+    };
+    std::vector<File> files;
+    std::string stdOut, stdErr;
+    int exitCode { 0 };
+};
+
+// Direct mode: maps the source file and command line to the headers that
+// were included last time, so a hit doesn't need to run cpp at all.
+struct Manifest
+{
+    struct Header {
+        std::string path;
+        uint64_t size { 0 };
+        int64_t mtime { 0 }; // nanoseconds
+        std::string hash;
+    };
+    std::vector<Header> headers;
+    std::string resultKey;
+    std::string cppStdErr;
+    std::vector<Entry::File> files; // written by cpp, e.g. the depfile
+};
+
+// Reads path into a new file in files
+bool addFile(std::vector<Entry::File> &files, const std::string &path);
+std::string key(const std::string &environmentHash, const std::vector<std::string> &commandLine, const std::string &preprocessedHash);
+bool load(const std::string &key, Entry &entry);
+bool store(const std::string &key, const Entry &entry);
+// Writes the entry's files and replays its output, returns false if any of
+// the files couldn't be written
+bool materialize(const Entry &entry);
+
+// Returns an empty key if the source file can't be used for direct mode
+std::string directKey(const std::string &environmentHash, const std::vector<std::string> &commandLine, const std::string &sourceFile);
+// Returns false if any of the headers can't be used for direct mode,
+// including ones that were modified after started
+bool addHeaders(Manifest &manifest, const std::set<std::string> &paths, time_t started);
+// Succeeds if the manifest's headers are unchanged and its result is cached
+bool lookup(const std::string &directKey, Manifest &manifest, Entry &entry);
+bool storeManifest(const std::string &directKey, const Manifest &manifest);
+// Collects the files named in the linemarkers of the preprocessed output
+void includedFiles(Client::Preprocessed *preprocessed, std::set<std::string> &paths);
+void parseDepFile(const std::string &contents, std::set<std::string> &paths);
+}
+
+#endif /* OBJECTCACHE_H */
@@ -0,0 +1,213 @@
+#include "Resources.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <cstdlib>
+#include <climits>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+enum {
+    SampleInterval = 250, // ms
+    PressureThreshold = 25, // percent
+    MemoryShare = 50 // percent
+};
+
+static const char *sCgroupRoot = "/sys/fs/cgroup";
+static bool sHasQuota = false;
+
+// for the small files in /proc and /sys
+static bool readFile(const std::string &path, std::string &contents)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char buf[1024];
+    ssize_t r;
+    while ((r = ::read(fd, buf, sizeof(buf) - 1)) == -1 && errno == EINTR);
+    ::close(fd);
+    if (r < 0)
+        return false;
+    contents.assign(buf, r);
+    return true;
+}
+
+// memory.stat is larger than what readFile() takes
+static bool readStat(const std::string &path, std::string &contents)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    contents = "\n";
+    char buf[4096];
+    ssize_t r;
+    while ((r = ::read(fd, buf, sizeof(buf))) > 0 || (r == -1 && errno == EINTR)) {
+        if (r > 0)
+            contents.append(buf, r);
+    }
+    ::close(fd);
+    return r == 0;
+}
+
+const std::string &Resources::cgroupDir()
+{
+    static const std::string dir = []() {
+        std::string ret;
+#ifdef __linux__
+        std::string contents;
+        if (!readFile("/proc/self/cgroup", contents))
+            return ret;
+        // the v2 hierarchy is the "0::/path" line
+        const size_t idx = contents.find("0::/");
+        if (idx == std::string::npos || (idx && contents[idx - 1] != '\n'))
+            return ret;
+        const size_t end = contents.find('\n', idx);
+        ret = sCgroupRoot + contents.substr(idx + 3, end == std::string::npos ? std::string::npos : end - idx - 3);
+        if (ret[ret.size() - 1] != '/')
+            ret += '/';
+        if (access((ret + "cgroup.controllers").c_str(), F_OK))
+            ret.clear();
+#endif
+        return ret;
+    }();
+    return dir;
+}
+
+size_t Resources::cpuCount()
+{
+    static const size_t count = []() {
+        size_t ret = std::thread::hardware_concurrency();
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (!sched_getaffinity(0, sizeof(set), &set))
+            ret = CPU_COUNT(&set);
+        // "max 100000" or "<quota> <period>", the tightest one up the tree wins
+        std::string dir = cgroupDir();
+        while (dir.size() > strlen(sCgroupRoot) + 1) {
+            std::string contents;
+            unsigned long long quota, period;
+            if (readFile(dir + "cpu.max", contents) && sscanf(contents.c_str(), "%llu %llu", &quota, &period) == 2 && quota && period) {
+                const size_t cpus = (quota + period - 1) / period;
+                if (cpus < ret)
+                    ret = cpus;
+                sHasQuota = true;
+            }
+            dir.resize(dir.rfind('/', dir.size() - 2) + 1);
+        }
+#endif
+        return std::max<size_t>(ret, 1);
+    }();
+    return count;
+}
+
+// some avg10 in percent, -1 if there's no pressure information
+static double cpuPressure()
+{
+    std::string contents;
+    const std::string &dir = Resources::cgroupDir();
+    if ((dir.empty() || !readFile(dir + "cpu.pressure", contents)) && !readFile("/proc/pressure/cpu", contents))
+        return -1;
+    const size_t idx = contents.find("some avg10=");
+    if (idx == std::string::npos)
+        return -1;
+    return atof(contents.c_str() + idx + 11);
+}
+
+size_t Resources::slotLimit(size_t configured, size_t running)
+{
+    if (!Config::adaptiveSlots)
+        return configured;
+    static unsigned long long sampled = 0;
+    static double load = 0, pressure = -1;
+    const unsigned long long now = Client::mono();
+    if (!sampled || now - sampled >= SampleInterval) {
+        sampled = now;
+        if (getloadavg(&load, 1) != 1)
+            load = 0;
+#ifdef __linux__
+        // the one minute average lags behind a build that just finished,
+        // what's runnable right now doesn't (minus ourselves)
+        std::string contents;
+        double loadavg;
+        unsigned int runnable;
+        if (readFile("/proc/loadavg", contents) && sscanf(contents.c_str(), "%lf %*f %*f %u/", &loadavg, &runnable) == 2 && runnable)
+            load = std::min<double>(load, runnable - 1);
+#endif
+        pressure = cpuPressure();
+    }
+
+    cpuCount(); // for sHasQuota
+    size_t ret = configured;
+    // the load average is the whole machine's, it doesn't say how much of
+    // a cpu quota is left
+    if (!sHasQuota && load > running) {
+        const size_t others = static_cast<size_t>(load - running);
+        ret = others >= ret ? 1 : ret - others;
+    }
+    // our own leases oversubscribe the CPUs on purpose (cpp-slots), that
+    // pressure is only a reason to back off when there's work that isn't
+    // ours competing for them
+    if (pressure >= PressureThreshold && load > running)
+        ret = std::min(ret, std::max<size_t>(running, 1));
+    if (ret < configured)
+        DEBUG("Slot limit %zu instead of %zu (load %.2f, pressure %.2f, %zu running)", ret, configured, load, pressure, running);
+    return std::max<size_t>(ret, 1);
+}
+
+// what we could still allocate, 0 if we don't know
+static size_t availableMemory()
+{
+    size_t ret = 0;
+#ifdef __linux__
+    std::string contents;
+    std::string dir = Resources::cgroupDir();
+    while (dir.size() > strlen(sCgroupRoot) + 1) {
+        unsigned long long max, current;
+        if (readFile(dir + "memory.max", contents) && sscanf(contents.c_str(), "%llu", &max) == 1
+            && readFile(dir + "memory.current", contents) && sscanf(contents.c_str(), "%llu", &current) == 1) {
+            // current counts the page cache, which fills the cgroup up to
+            // max soon enough. What's inactive is given back before anyone
+            // runs out, like the working set that the OOM killer cares about.
+            std::string stat;
+            unsigned long long inactive;
+            size_t idx;
+            if (readStat(dir + "memory.stat", stat) && (idx = stat.find("\ninactive_file ")) != std::string::npos
+                && sscanf(stat.c_str() + idx + 15, "%llu", &inactive) == 1) {
+                current -= std::min(current, inactive);
+            }
+            const size_t available = max > current ? max - current : 0;
+            if (!ret || available < ret)
+                ret = std::max<size_t>(available, 1);
+        }
+        dir.resize(dir.rfind('/', dir.size() - 2) + 1);
+    }
+    if (!ret && readFile("/proc/meminfo", contents)) {
+        const size_t idx = contents.find("MemAvailable:");
+        unsigned long long kb;
+        if (idx != std::string::npos && sscanf(contents.c_str() + idx + 13, "%llu", &kb) == 1)
+            ret = kb * 1024;
+    }
+#endif
+    return ret;
+}
+
+size_t Resources::memoryBudget(size_t configured, size_t reserved)
+{
+    if (configured)
+        return configured;
+    static unsigned long long sampled = 0;
+    static size_t available = 0;
+    const unsigned long long now = Client::mono();
+    if (!sampled || now - sampled >= SampleInterval) {
+        sampled = now;
+        available = availableMemory();
+    }
+    if (!available)
+        return SIZE_MAX;
+    return (available + reserved) / 100 * MemoryShare;
+}
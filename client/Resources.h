@@ -0,0 +1,33 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+#include <cstddef>
+#include <string>
+
+// What this machine, or the cgroup we're in, lets us use.
+namespace Resources {
+// The CPUs we may run on: the affinity mask capped by the cgroup v2
+// cpu.max quota of our cgroup and its ancestors. This is what the slot
+// counts default to.
+size_t cpuCount();
+// our cgroup v2 directory, empty if there isn't one
+const std::string &cgroupDir();
+// With adaptive-slots, how many compile or preprocess slots to hand out
+// right now given that running slots (of any type) are held on the
+// machine. Without a cpu quota other work on the machine, measured by the
+// load average, is taken away from configured. While there's CPU pressure
+// (runnable tasks waiting for a CPU a good part of the last 10s) and more
+// runnable tasks than running slots, so it isn't only our own doing, no
+// more slots are handed out than are held. That shrinks the count by one
+// every time one is released until it eases.
+size_t slotLimit(size_t configured, size_t running);
+// The bytes of preprocessed output all fiskc processes may hold at once,
+// reserved is what they hold now. Unless one is configured it's half of
+// what's available to us: the tightest memory.max minus memory.current up
+// our cgroup tree (not counting inactive page cache, which is reclaimed
+// first), or MemAvailable without a limit, plus reserved since that's
+// already been taken out. SIZE_MAX if we can't tell.
+size_t memoryBudget(size_t configured, size_t reserved);
+}
+
+#endif /* RESOURCES_H */
@@ -0,0 +1,153 @@
+#include "RingBuffer.h"
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum {
+    MaxSpareChunks = 8,
+    MaxIOVecs = 64
+};
+
+RingBuffer::Chunk RingBuffer::allocate()
+{
+    if (!mSpare.empty()) {
+        Chunk ret = std::move(mSpare.back());
+        mSpare.pop_back();
+        return ret;
+    }
+    return Chunk(new unsigned char[ChunkSize]);
+}
+
+void RingBuffer::recycle(Chunk &&chunk)
+{
+    if (mSpare.size() < MaxSpareChunks)
+        mSpare.push_back(std::move(chunk));
+}
+
+void RingBuffer::clear()
+{
+    while (!mChunks.empty()) {
+        recycle(std::move(mChunks.front()));
+        mChunks.pop_front();
+    }
+    mHead = mTail = mSize = 0;
+}
+
+void RingBuffer::append(const void *data, size_t len)
+{
+    const unsigned char *src = static_cast<const unsigned char *>(data);
+    mSize += len;
+    while (len) {
+        if (mChunks.empty() || mTail == ChunkSize) {
+            mChunks.push_back(allocate());
+            mTail = 0;
+        }
+        const size_t n = std::min<size_t>(len, ChunkSize - mTail);
+        memcpy(mChunks.back().get() + mTail, src, n);
+        mTail += n;
+        src += n;
+        len -= n;
+    }
+}
+
+size_t RingBuffer::copy(void *data, size_t len) const
+{
+    unsigned char *dst = static_cast<unsigned char *>(data);
+    len = std::min(len, mSize);
+    size_t offset = mHead, copied = 0;
+    for (size_t i=0; copied < len; ++i) {
+        const size_t n = std::min(len - copied, chunkEnd(i) - offset);
+        memcpy(dst + copied, mChunks[i].get() + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+void RingBuffer::consume(size_t len)
+{
+    len = std::min(len, mSize);
+    mSize -= len;
+    while (len) {
+        const size_t available = chunkEnd(0) - mHead;
+        if (len < available) {
+            mHead += len;
+            break;
+        }
+        len -= available;
+        recycle(std::move(mChunks.front()));
+        mChunks.pop_front();
+        mHead = 0;
+    }
+    if (mChunks.empty())
+        mTail = 0;
+}
+
+ssize_t RingBuffer::readFrom(int fd, size_t max)
+{
+    iovec iov[MaxIOVecs];
+    int count = 0;
+    size_t space = 0;
+    if (!mChunks.empty() && mTail < ChunkSize) {
+        iov[count].iov_base = mChunks.back().get() + mTail;
+        iov[count].iov_len = ChunkSize - mTail;
+        space += iov[count++].iov_len;
+    }
+    Chunk fresh[MaxIOVecs];
+    int freshCount = 0;
+    while (space < max && count < MaxIOVecs) {
+        fresh[freshCount] = allocate();
+        iov[count].iov_base = fresh[freshCount++].get();
+        iov[count].iov_len = ChunkSize;
+        space += iov[count++].iov_len;
+    }
+
+    ssize_t r;
+    do {
+        r = ::readv(fd, iov, count);
+    } while (r == -1 && errno == EINTR);
+
+    size_t remaining = r > 0 ? r : 0;
+    mSize += remaining;
+    if (!mChunks.empty() && mTail < ChunkSize) {
+        const size_t n = std::min<size_t>(remaining, ChunkSize - mTail);
+        mTail += n;
+        remaining -= n;
+    }
+    for (int i=0; i<freshCount; ++i) {
+        if (remaining) {
+            mChunks.push_back(std::move(fresh[i]));
+            mTail = std::min<size_t>(remaining, ChunkSize);
+            remaining -= mTail;
+        } else {
+            recycle(std::move(fresh[i]));
+        }
+    }
+    return r;
+}
+
+ssize_t RingBuffer::writeTo(int fd, size_t max)
+{
+    if (!mSize)
+        return 0;
+    iovec iov[MaxIOVecs];
+    int count = 0;
+    size_t offset = mHead, total = 0;
+    for (size_t i=0; i<mChunks.size() && count < MaxIOVecs && total < max; ++i) {
+        iov[count].iov_base = mChunks[i].get() + offset;
+        iov[count].iov_len = std::min(chunkEnd(i) - offset, max - total);
+        total += iov[count++].iov_len;
+        offset = 0;
+    }
+
+    ssize_t r;
+    do {
+        r = ::writev(fd, iov, count);
+    } while (r == -1 && errno == EINTR);
+    if (r > 0)
+        consume(r);
+    return r;
+}
@@ -0,0 +1,54 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+
+// A byte queue kept in fixed size chunks. Appending never moves what's
+// already there and consuming from the front just drops whole chunks so
+// large messages don't cost a memmove per read or write. Reading from and
+// writing to fds goes through readv/writev over several chunks at a time.
+class RingBuffer
+{
+public:
+    enum { ChunkSize = 64 * 1024 };
+
+    RingBuffer() {}
+
+    size_t size() const { return mSize; }
+    bool empty() const { return !mSize; }
+    void clear();
+
+    void append(const void *data, size_t len);
+    // Copies up to len bytes from the front without consuming them
+    size_t copy(void *data, size_t len) const;
+    void consume(size_t len);
+    size_t read(void *data, size_t len)
+    {
+        len = copy(data, len);
+        consume(len);
+        return len;
+    }
+
+    // Like ::read/::write, returns -1 and leaves errno set on failure
+    ssize_t readFrom(int fd, size_t max = 4 * ChunkSize);
+    ssize_t writeTo(int fd, size_t max = 64 * ChunkSize);
+private:
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+
+    typedef std::unique_ptr<unsigned char[]> Chunk;
+    Chunk allocate();
+    void recycle(Chunk &&chunk);
+    size_t chunkEnd(size_t idx) const { return idx + 1 == mChunks.size() ? mTail : ChunkSize; }
+
+    std::deque<Chunk> mChunks;
+    std::vector<Chunk> mSpare;
+    size_t mHead { 0 }; // offset of the first byte in the first chunk
+    size_t mTail { 0 }; // bytes used in the last chunk
+    size_t mSize { 0 };
+};
+
+#endif /* RINGBUFFER_H */
@@ -12,6 +12,7 @@ public:
     virtual void onConected() override
     {
         Client::data().watchdog->transition(Watchdog::ConnectedToScheduler);
+        Client::phase(Client::SchedulerConnected);
     }
     virtual void onMessage(MessageType type, const void *data, size_t len) override
     {
@@ -30,14 +31,7 @@ public:
                 needsEnvironment = true;
                 done = true;
             } else if (type == "slave") {
-                slaveIp = msg["ip"].string_value();
-                slaveHostname = msg["hostname"].string_value();
-                slavePort = msg["port"].int_value();
-                jobId = msg["id"].int_value();
-                Client::data().maintainSemaphores = msg["maintain_semaphores"].bool_value();
-                DEBUG("type %d", msg["port"].type());
-                DEBUG("Got here %s:%d", slaveIp.c_str(), slavePort);
-                done = true;
+                onSlave(msg);
             } else {
                 ERROR("Unexpected message type: %s", type.c_str());
             }
@@ -46,10 +40,24 @@ public:
         }
     }
 
+    void onSlave(const json11::Json &msg)
+    {
+        slaveIp = msg["ip"].string_value();
+        slaveHostname = msg["hostname"].string_value();
+        slavePort = msg["port"].int_value();
+        jobId = msg["id"].int_value();
+        slaveCompileSpeed = msg["compileSpeed"].number_value();
+        DEBUG("type %d", msg["port"].type());
+        DEBUG("Got here %s:%d", slaveIp.c_str(), slavePort);
+        done = true;
+    }
+
     bool done { false };
     bool needsEnvironment { false };
     int jobId { 0 };
     uint16_t slavePort { 0 };
+    // average preprocessed bytes per ms, 0 if the scheduler doesn't know
+    double slaveCompileSpeed { 0 };
     std::string slaveIp, slaveHostname;
 };
 
@@ -1,74 +1,240 @@
 #include "Select.h"
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
 
-int Select::exec(int timeoutMs) const
+static void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags != -1)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    flags = fcntl(fd, F_GETFD, 0);
+    if (flags != -1)
+        fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+Select::Select()
+{
+    if (pipe(mPipe) == -1) {
+        mPipe[0] = mPipe[1] = -1;
+    } else {
+        setNonBlocking(mPipe[0]);
+        setNonBlocking(mPipe[1]);
+    }
+#ifdef __linux__
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpoll == -1) {
+        ERROR("Failed to create epoll (%d %s)", errno, strerror(errno));
+    } else if (mPipe[0] != -1) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mPipe[0], &ev) == -1)
+            ERROR("Failed to add wakeup pipe to epoll (%d %s)", errno, strerror(errno));
+    }
+#endif
+}
+
+Select::~Select()
+{
+    for (auto &it : mSockets) {
+        assert(it.first->mSelect == this);
+        it.first->mSelect = nullptr;
+    }
+#ifdef __linux__
+    if (mEpoll != -1)
+        ::close(mEpoll);
+#endif
+    if (mPipe[0] != -1)
+        ::close(mPipe[0]);
+    if (mPipe[1] != -1)
+        ::close(mPipe[1]);
+}
+
+void Select::add(Socket *socket)
+{
+    assert(!socket->mSelect);
+    socket->mSelect = this;
+    mSockets[socket];
+}
+
+void Select::remove(Socket *socket)
+{
+    assert(socket->mSelect == this);
+    socket->mSelect = nullptr;
+    auto it = mSockets.find(socket);
+    assert(it != mSockets.end());
+    unregister(socket, it->second);
+    mSockets.erase(it);
+}
+
+void Select::unregister(Socket *socket, Registration &registration)
+{
+#ifdef __linux__
+    if (registration.fd != -1 && registration.mode) {
+        // The fd might have been closed and handed to another one of our
+        // sockets, in which case it's not ours to remove.
+        bool shared = false;
+        for (const auto &it : mSockets) {
+            if (it.first != socket && it.second.fd == registration.fd && it.second.mode) {
+                shared = true;
+                break;
+            }
+        }
+        if (!shared)
+            epoll_ctl(mEpoll, EPOLL_CTL_DEL, registration.fd, nullptr);
+    }
+#else
+    (void)socket;
+#endif
+    registration = Registration();
+}
+
+void Select::update(Socket *socket, Registration &registration)
+{
+    const int fd = socket->fd();
+    const unsigned int mode = fd == -1 ? Socket::None : socket->mode();
+    if (fd == registration.fd && mode == registration.mode)
+        return;
+#ifdef __linux__
+    if (registration.fd != fd || !mode)
+        unregister(socket, registration);
+    if (mode) {
+        epoll_event ev = {};
+        ev.events = EPOLLET;
+        if (mode & Socket::Read)
+            ev.events |= EPOLLIN | EPOLLRDHUP;
+        if (mode & Socket::Write)
+            ev.events |= EPOLLOUT;
+        ev.data.ptr = socket;
+        // Modifying also rearms the edge so we'll hear about it if the
+        // socket already is readable/writable.
+        int op = registration.mode ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        int ret = epoll_ctl(mEpoll, op, fd, &ev);
+        if (ret == -1 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+            op = EPOLL_CTL_MOD;
+            ret = epoll_ctl(mEpoll, op, fd, &ev);
+        }
+        if (ret == -1) {
+            ERROR("Failed to %s %d in epoll (%d %s)", op == EPOLL_CTL_ADD ? "add" : "modify", fd, errno, strerror(errno));
+            return;
+        }
+    }
+#endif
+    registration.fd = fd;
+    registration.mode = mode;
+}
+
+void Select::dispatch(Socket *socket, bool readable, bool writable)
+{
+    const auto it = mSockets.find(socket);
+    if (it == mSockets.end())
+        return;
+    const unsigned int mode = it->second.mode;
+    if (readable && mode & Socket::Read)
+        socket->onRead();
+    if (writable && mode & Socket::Write)
+        socket->onWrite();
+}
+
+void Select::drainPipe()
+{
+    char buf[64];
+    while (true) {
+        const ssize_t r = ::read(mPipe[0], buf, sizeof(buf));
+        if (r > 0 || (r == -1 && errno == EINTR))
+            continue;
+        break;
+    }
+}
+
+int Select::exec(int timeoutMs)
 {
-    fd_set r, w;
-    FD_ZERO(&r);
-    FD_ZERO(&w);
-    int max = mPipe[0];
-    FD_SET(mPipe[0], &r);
-    std::vector<int> timeouts;
     const unsigned long long before = Client::mono();
-    for (Socket *socket : mSockets) {
+    unsigned long long deadline = ULLONG_MAX;
+    mDeadlines.clear();
+#ifndef __linux__
+    mPollFds.clear();
+    mPollSockets.clear();
+    if (mPipe[0] != -1)
+        mPollFds.push_back({ mPipe[0], POLLIN, 0 });
+#endif
+    for (auto &it : mSockets) {
+        Socket *socket = it.first;
         const int to = socket->timeout();
-        if (to != -1 && (timeoutMs == -1 || to < timeoutMs))
-            timeoutMs = to;
-        timeouts.push_back(to);
-        const int fd = socket->fd();
-        if (fd == -1)
-            continue;
-        const unsigned int mode = socket->mode();
-        if (!mode)
-            continue;
-        max = std::max(fd, max);
-        if (mode & Socket::Read) {
-            FD_SET(fd, &r);
+        if (to >= 0) {
+            mDeadlines.emplace_back(before + to, socket);
+            deadline = std::min(deadline, before + to);
         }
-        if (mode & Socket::Write) {
-            FD_SET(fd, &w);
+        update(socket, it.second);
+#ifndef __linux__
+        if (it.second.mode) {
+            short events = 0;
+            if (it.second.mode & Socket::Read)
+                events |= POLLIN;
+            if (it.second.mode & Socket::Write)
+                events |= POLLOUT;
+            mPollFds.push_back({ it.second.fd, events, 0 });
+            mPollSockets.push_back(socket);
         }
+#endif
     }
-    int ret;
-    do {
-        struct timeval t = {};
-        struct timeval *timeout = timeoutMs == -1 ? 0 : &t;
-        if (timeout) {
-            timeout->tv_sec = timeoutMs / 1000;
-            timeout->tv_usec = (timeoutMs % 1000) / 1000;
-        }
-        ret = select(max + 1, &r, &w, 0, timeout);
-    } while (ret == EINTR);
-    if (ret == -1) {
+    if (deadline != ULLONG_MAX) {
+        const int to = static_cast<int>(deadline - before);
+        if (timeoutMs == -1 || to < timeoutMs)
+            timeoutMs = to;
+    }
+
+    int ret = 0;
+#ifdef __linux__
+    mEvents.resize(mSockets.size() + 1);
+    const int count = epoll_wait(mEpoll, &mEvents[0], static_cast<int>(mEvents.size()), timeoutMs);
+#else
+    const int count = poll(&mPollFds[0], mPollFds.size(), timeoutMs);
+#endif
+    if (count == -1 && errno != EINTR) {
         ERROR("Select failed %d %s", errno, strerror(errno));
         return -1;
     }
 
-    const unsigned long long after = ret ? 0 : Client::mono();
-    size_t idx = 0;
-    if (FD_ISSET(mPipe[0], &r)) {
-        --ret;
-        char ch;
-        int readRet;
-        do {
-            readRet = ::read(mPipe[0], &ch, 1);
-        } while (readRet == -1 && errno == EINTR);
+#ifdef __linux__
+    for (int i=0; i<count; ++i) {
+        const epoll_event &ev = mEvents[i];
+        Socket *socket = static_cast<Socket *>(ev.data.ptr);
+        if (!socket) {
+            drainPipe();
+            continue;
+        }
+        ++ret;
+        dispatch(socket,
+                 ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR),
+                 ev.events & (EPOLLOUT | EPOLLHUP | EPOLLERR));
     }
-    for (Socket *socket : mSockets) {
-        if (!ret) {
-            if (timeouts[idx] >= 0) {
-                const unsigned long long socketTimeout = timeouts[idx] + before;
-                if (after >= socketTimeout)
-                    socket->onTimeout();
-            }
+#else
+    if (count > 0) {
+        size_t idx = 0;
+        if (mPipe[0] != -1) {
+            if (mPollFds[0].revents)
+                drainPipe();
             ++idx;
-        } else {
-            const int fd = socket->fd();
-            if (fd != -1) {
-                if (FD_ISSET(fd, &r))
-                    socket->onRead();
-                if (FD_ISSET(fd, &w))
-                    socket->onWrite();
-            }
+        }
+        for (Socket *socket : mPollSockets) {
+            const short revents = mPollFds[idx++].revents;
+            if (!revents)
+                continue;
+            ++ret;
+            dispatch(socket,
+                     revents & (POLLIN | POLLHUP | POLLERR),
+                     revents & (POLLOUT | POLLHUP | POLLERR));
+        }
+    }
+#endif
+
+    if (deadline != ULLONG_MAX) {
+        const unsigned long long after = Client::mono();
+        for (const auto &it : mDeadlines) {
+            if (it.first <= after)
+                it.second->onTimeout();
         }
     }
 
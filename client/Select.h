@@ -1,13 +1,17 @@
 #ifndef SELECT_H
 #define SELECT_H
 
-#include <set>
 #include <map>
+#include <vector>
 #include <errno.h>
 #include <string.h>
 #include <functional>
-#include <sys/select.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #include "Log.h"
 #include "Client.h"
 
@@ -32,34 +36,43 @@ private:
     friend class Select;
 };
 
+// On Linux sockets are registered edge triggered with epoll so a Socket's
+// onRead/onWrite have to read/write until EAGAIN. fd() and mode() are
+// checked before each wait and the registration is only touched when they
+// change. Elsewhere we fall back to poll(). Socket::timeout() is asked
+// before each wait as well and the wait ends at the earliest deadline,
+// there are only ever a few sockets so that's cheaper than keeping them
+// sorted.
 class Select
 {
 public:
-    Select()
-    {
-        if (pipe(mPipe) == -1) {
-            mPipe[0] = mPipe[1] = -1;
-        }
-    }
-    ~Select()
-    {
-        if (mPipe[0] != -1)
-            ::close(mPipe[0]);
-        if (mPipe[1] != -1)
-            ::close(mPipe[1]);
-        for (Socket *socket : mSockets) {
-            assert(socket->mSelect == this);
-            socket->mSelect = nullptr;
-        }
-    }
-    void add(Socket *socket) { assert(!socket->mSelect); socket->mSelect = this; mSockets.insert(socket); }
-    void remove(Socket *socket) { assert(socket->mSelect == this); socket->mSelect = nullptr; mSockets.erase(socket); }
+    Select();
+    ~Select();
+    void add(Socket *socket);
+    void remove(Socket *socket);
 
-    int exec(int timeoutMs = -1) const;
+    int exec(int timeoutMs = -1);
     void wakeup();
 private:
-    std::set<Socket *> mSockets;
+    struct Registration {
+        int fd { -1 };
+        unsigned int mode { Socket::None };
+    };
+    void update(Socket *socket, Registration &registration);
+    void unregister(Socket *socket, Registration &registration);
+    void dispatch(Socket *socket, bool readable, bool writable);
+    void drainPipe();
+
+    std::map<Socket *, Registration> mSockets;
+    std::vector<std::pair<unsigned long long, Socket *> > mDeadlines;
     int mPipe[2];
+#ifdef __linux__
+    int mEpoll { -1 };
+    std::vector<epoll_event> mEvents;
+#else
+    std::vector<pollfd> mPollFds;
+    std::vector<Socket *> mPollSockets;
+#endif
 };
 
 inline void Socket::wakeup()
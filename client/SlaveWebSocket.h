@@ -3,6 +3,7 @@
 
 #include "WebSocket.h"
 #include "Client.h"
+#include "Compression.h"
 #include "Watchdog.h"
 #include <string>
 
@@ -10,6 +11,10 @@ class SlaveWebSocket : public WebSocket
 {
 public:
     bool wait { false };
+    bool compressed { false };
+    // stdout/stderr are only collected, not printed, while a speculative
+    // local compile might still win
+    bool holdOutput { false };
     virtual void onConected() override
     {
     }
@@ -32,7 +37,9 @@ public:
             if (type == "stderr") {
                 const std::string output = msg["data"].string_value();
                 if (!output.empty()) {
-                    fwrite(output.c_str(), 1, output.size(), stderr);
+                    if (!holdOutput)
+                        fwrite(output.c_str(), 1, output.size(), stderr);
+                    stdErr += output;
                 }
                 return;
             }
@@ -40,7 +47,9 @@ public:
             if (type == "stdout") {
                 const std::string output = msg["data"].string_value();
                 if (!output.empty()) {
-                    fwrite(output.c_str(), 1, output.size(), stdout);
+                    if (!holdOutput)
+                        fwrite(output.c_str(), 1, output.size(), stdout);
+                    stdOut += output;
                 }
                 return;
             }
@@ -86,20 +95,24 @@ public:
                         Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
                         return;
                     }
+                    outputs.push_back(ff.path);
                 }
-                f = fopen(files[0].path.c_str(), "w");
-                if (!f) {
+                if (compressed && !inflater.init()) {
+                    Client::data().watchdog->stop();
+                    Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+                    return;
+                }
+                if (!file.open(files[0].path, files[0].remaining)) {
                     ERROR("Can't open file: %s", files[0].path.c_str());
                     Client::data().watchdog->stop();
                     Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
                     return;
                 }
-                assert(f);
-                if (files[0].remaining)
-                    fill(0, 0);
-            } else {
-                done = true;
+                // empty files don't get any data
+                fill(0, 0);
             }
+            if (files.empty())
+                done = true;
         } else {
             DEBUG("Got binary data: %zu bytes", len);
             if (files.empty()) {
@@ -108,7 +121,26 @@ public:
                 Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
                 return;
             }
-            fill(reinterpret_cast<const unsigned char *>(data), len);
+            if (compressed) {
+                const bool ok = inflater.inflate(data, len, [this](const unsigned char *bytes, size_t size) {
+                        if (files.empty()) {
+                            ERROR("Extraneous bytes. Abandon ship (%zu)", size);
+                            return false;
+                        }
+                        fill(bytes, size);
+                        return true;
+                    });
+                if (ok && inflater.isFinished())
+                    fill(0, 0);
+                if (!ok || (inflater.isFinished() && !files.empty())) {
+                    ERROR("Failed to inflate data from slave");
+                    Client::data().watchdog->stop();
+                    Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+                    return;
+                }
+            } else {
+                fill(reinterpret_cast<const unsigned char *>(data), len);
+            }
             if (files.empty())
                 done = true;
         }
@@ -116,40 +148,35 @@ public:
 
     void fill(const unsigned char *data, const size_t bytes)
     {
-        assert(f);
-        auto *front = &files.front();
         size_t offset = 0;
-        do {
-            const size_t b = std::min(front->remaining, bytes);
-            assert(f);
+        while (!files.empty()) {
+            File &front = files.front();
+            const size_t b = std::min(front.remaining, bytes - offset);
             if (b) {
-                if (fwrite(data + offset, 1, b, f) != b) {
-                    ERROR("Failed to write to file %s (%d %s)", front->path.c_str(), errno, strerror(errno));
+                if (!file.write(data + offset, b)) {
                     Client::data().watchdog->stop();
                     Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
                     return;
                 }
                 offset += b;
-                front->remaining -= b;
+                front.remaining -= b;
             }
-            if (!front->remaining) {
-                fclose(f);
-                f = 0;
-                files.erase(files.begin());
-                if (files.empty())
-                    break;
-                front = &files.front();
-                f = fopen(front->path.c_str(), "w");
-                if (!f) {
-                    Client::data().watchdog->stop();
-                    Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
-                    return;
-                }
-
-                assert(f);
-                continue;
+            if (front.remaining)
+                break;
+            if (!file.commit()) {
+                Client::data().watchdog->stop();
+                Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+                return;
             }
-        } while (offset < bytes);
+            files.erase(files.begin());
+            if (files.empty())
+                break;
+            if (!file.open(files.front().path, files.front().remaining)) {
+                Client::data().watchdog->stop();
+                Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+                return;
+            }
+        }
         if (offset < bytes) {
             ERROR("Extraneous bytes. Abandon ship (%zu/%zu)", offset, bytes);
             Client::data().watchdog->stop();
@@ -163,7 +190,11 @@ public:
     };
 
     std::vector<File> files;
-    FILE *f { 0 };
+    // everything the slave sent us, for the object cache
+    std::vector<std::string> outputs;
+    std::string stdOut, stdErr;
+    Inflater inflater;
+    Client::OutputFile file;
     bool done { false };
 };
 
@@ -0,0 +1,522 @@
+#include "SlotBroker.h"
+#include "Config.h"
+#include "Log.h"
+#include "Resources.h"
+#include <algorithm>
+#include <climits>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+    BrokerMagic = 0x34534c46, // FLS4
+    MaxLeases = 1024,
+    MaxWaiters = 1024,
+    MaxOwners = 4096,
+    // waiters look for leases held by dead processes this often
+    WaitTimeout = 500,
+    ReclaimInterval = 250,
+    TypeCount = Client::Slot::Memory + 1,
+    // what a preprocess is expected to produce before we've seen any
+    DefaultExpectedBytes = 4 * 1024 * 1024
+};
+
+struct Lease
+{
+    int32_t pid; // 0 if the lease is free, in the holder's pid namespace
+    uint32_t type;
+    uint32_t priority; // Client::Priority
+    uint32_t owner; // see owner()
+    uint64_t units; // 1 for slots, bytes for memory
+    uint64_t acquired;
+    char what[48];
+};
+
+struct Waiter
+{
+    int32_t pid; // 0 if the entry is free
+    uint32_t type;
+    uint32_t granted; // lease + 1, waited on with futex(2)
+    uint32_t priority;
+    uint32_t owner;
+    uint32_t padding;
+    uint64_t units;
+    uint64_t limit;
+    uint64_t cap; // background-slots of the waiter, 0 for none
+    uint64_t ticket;
+    uint64_t since;
+    char what[48];
+};
+
+struct Shared
+{
+    uint32_t magic;
+    uint32_t size;
+    uint64_t nextTicket;
+    uint64_t lastReclaim;
+    uint64_t averageBytes; // of the preprocessed output
+    Lease leases[MaxLeases];
+    Waiter waiters[MaxWaiters];
+};
+
+static int sFd = -1;
+static Shared *sShared = nullptr;
+static int sOwnerFd = -1;
+static pid_t sOwnerPid = 0;
+static uint32_t sOwner = 0;
+// flock(2) locks belong to the open file, they don't keep our own threads
+// apart
+static std::mutex sMutex;
+
+class Locker
+{
+public:
+    Locker()
+        : mLock(sMutex)
+    {
+        while (::flock(sFd, LOCK_EX) == -1 && errno == EINTR);
+    }
+    ~Locker()
+    {
+        ::flock(sFd, LOCK_UN);
+    }
+private:
+    std::unique_lock<std::mutex> mLock;
+};
+
+static Shared *shared()
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+            const std::string path = Config::slotsFile;
+            if (path.empty())
+                return;
+            const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (fd == -1) {
+                ERROR("Failed to open %s: %d %s", path.c_str(), errno, strerror(errno));
+                return;
+            }
+            // shared by everyone regardless of umask
+            ::fchmod(fd, 0666);
+            while (::flock(fd, LOCK_EX) == -1 && errno == EINTR);
+            struct stat st;
+            void *mapped = MAP_FAILED;
+            if (!::fstat(fd, &st) && (st.st_size >= static_cast<off_t>(sizeof(Shared)) || !::ftruncate(fd, sizeof(Shared))))
+                mapped = ::mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ERROR("Failed to map %s: %d %s", path.c_str(), errno, strerror(errno));
+                ::close(fd);
+                return;
+            }
+            Shared *s = static_cast<Shared *>(mapped);
+            if (s->magic != BrokerMagic || s->size != sizeof(Shared)) {
+                memset(s, 0, sizeof(Shared));
+                s->magic = BrokerMagic;
+                s->size = sizeof(Shared);
+            }
+            ::flock(fd, LOCK_UN);
+            sFd = fd;
+            sShared = s;
+        });
+    return sShared;
+}
+
+#ifdef F_OFD_SETLK
+// open file description locks aren't tied to a pid so they work across pid
+// namespaces sharing the file
+#define OWNER_SETLK F_OFD_SETLK
+#define OWNER_GETLK F_OFD_GETLK
+#else
+#define OWNER_SETLK F_SETLK
+#define OWNER_GETLK F_GETLK
+#endif
+
+// the byte past the end of the file whose lock says owner is alive
+static inline struct flock ownerLock(uint32_t owner)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = sizeof(Shared) + owner - 1;
+    lock.l_len = 1;
+    return lock;
+}
+
+static inline bool mine(uint32_t owner)
+{
+    return owner && owner == sOwner && sOwnerPid == getpid();
+}
+
+// Leases and waiters belong to an owner rather than a pid. An owner is a
+// byte of the file we hold a lock on, the kernel drops that when we die so
+// unlike a pid it can't be reused by someone else while our leases are
+// still there. Whatever is left with an owner we take over belonged to a
+// process that's gone. Called with the file locked.
+static uint32_t owner(Shared *s)
+{
+    const pid_t pid = getpid();
+    if (sOwner && sOwnerPid == pid)
+        return sOwner;
+    // a forked child gets its own, the one we inherited is our parent's
+    if (sOwnerFd != -1)
+        ::close(sOwnerFd);
+    sOwner = 0;
+    sOwnerPid = pid;
+    const std::string path = Config::slotsFile;
+    sOwnerFd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (sOwnerFd == -1) {
+        ERROR("Failed to open %s: %d %s", path.c_str(), errno, strerror(errno));
+        return 0;
+    }
+    for (uint32_t i=0; i<MaxOwners; ++i) {
+        const uint32_t candidate = (pid + i) % MaxOwners + 1;
+        struct flock lock = ownerLock(candidate);
+        if (::fcntl(sOwnerFd, OWNER_SETLK, &lock) == -1)
+            continue;
+        for (Lease &lease : s->leases) {
+            if (lease.pid && lease.owner == candidate)
+                memset(&lease, 0, sizeof(lease));
+        }
+        for (Waiter &waiter : s->waiters) {
+            if (waiter.pid && waiter.owner == candidate)
+                memset(&waiter, 0, sizeof(waiter));
+        }
+        sOwner = candidate;
+        return sOwner;
+    }
+    ERROR("No free owner in %s", path.c_str());
+    return 0;
+}
+
+static inline bool alive(uint32_t owner)
+{
+    if (mine(owner))
+        return true;
+    if (!owner || owner > MaxOwners)
+        return false;
+    struct flock lock = ownerLock(owner);
+    if (::fcntl(sFd, OWNER_GETLK, &lock) == -1)
+        return true; // can't tell
+    return lock.l_type != F_UNLCK;
+}
+
+static inline void wake(uint32_t *word)
+{
+#ifdef __linux__
+    ::syscall(SYS_futex, word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+static inline void waitFor(uint32_t *word)
+{
+#ifdef __linux__
+    const timespec timeout = { WaitTimeout / 1000, (WaitTimeout % 1000) * 1000000 };
+    ::syscall(SYS_futex, word, FUTEX_WAIT, 0, &timeout, nullptr, 0);
+#else
+    // no futex, poll
+    (void)word;
+    usleep(10 * 1000);
+#endif
+}
+
+static inline void copyWhat(char (&dest)[48], const char *what)
+{
+    strncpy(dest, what, sizeof(dest) - 1);
+    dest[sizeof(dest) - 1] = '\0';
+}
+
+// frees leases and waiters of processes that are gone, returns true if
+// there were any
+static bool reclaim(Shared *s, bool force)
+{
+    const unsigned long long now = Client::mono();
+    if (!force && now - s->lastReclaim < ReclaimInterval)
+        return false;
+    s->lastReclaim = now;
+    bool ret = false;
+    for (Lease &lease : s->leases) {
+        if (lease.pid && !alive(lease.owner)) {
+            DEBUG("Reclaiming %s slot from dead process %d (%s)",
+                  Client::Slot::typeToString(static_cast<Client::Slot::Type>(lease.type)), lease.pid, lease.what);
+            memset(&lease, 0, sizeof(lease));
+            ret = true;
+        }
+    }
+    for (Waiter &waiter : s->waiters) {
+        if (waiter.pid && !alive(waiter.owner)) {
+            memset(&waiter, 0, sizeof(waiter));
+            ret = true;
+        }
+    }
+    return ret;
+}
+
+static bool grant(Shared *s, Waiter &waiter)
+{
+    for (size_t i=0; i<MaxLeases; ++i) {
+        Lease &lease = s->leases[i];
+        if (lease.pid)
+            continue;
+        lease.pid = waiter.pid;
+        lease.type = waiter.type;
+        lease.priority = waiter.priority;
+        lease.owner = waiter.owner;
+        lease.units = waiter.units;
+        lease.acquired = Client::mono();
+        memcpy(lease.what, waiter.what, sizeof(lease.what));
+        __atomic_store_n(&waiter.granted, i + 1, __ATOMIC_RELEASE);
+        wake(&waiter.granted);
+        return true;
+    }
+    return false;
+}
+
+// hands free slots to the waiters of the highest priority that have
+// waited the longest
+static void dispatch(Shared *s)
+{
+    bool reclaimed = false;
+    while (true) {
+        size_t held[TypeCount] = { 0 }, background[TypeCount] = { 0 };
+        size_t running = 0;
+        for (const Lease &lease : s->leases) {
+            if (lease.pid && lease.type < TypeCount) {
+                held[lease.type] += lease.units;
+                if (lease.type != Client::Slot::Memory) {
+                    ++running;
+                    if (lease.priority == Client::Background)
+                        ++background[lease.type];
+                }
+            }
+        }
+        Waiter *heads[TypeCount] = { nullptr };
+        bool granted = false, blocked = false;
+        for (Waiter &waiter : s->waiters) {
+            if (!waiter.pid || waiter.granted || waiter.type >= TypeCount)
+                continue;
+            // background jobs at their cap wait without holding up anyone
+            // behind them
+            if (waiter.priority == Client::Background && waiter.cap && waiter.type != Client::Slot::Memory
+                && background[waiter.type] >= waiter.cap) {
+                blocked = true;
+                continue;
+            }
+            const Waiter *head = heads[waiter.type];
+            if (!head || waiter.priority > head->priority || (waiter.priority == head->priority && waiter.ticket < head->ticket))
+                heads[waiter.type] = &waiter;
+        }
+        for (Waiter *head : heads) {
+            if (!head)
+                continue;
+            size_t limit = head->limit;
+            switch (head->type) {
+            case Client::Slot::Compile:
+            case Client::Slot::Cpp:
+                limit = Resources::slotLimit(limit, running);
+                break;
+            case Client::Slot::Memory:
+                limit = Resources::memoryBudget(limit, held[head->type]);
+                break;
+            case Client::Slot::DesiredCompile: // a floor for local work, it doesn't adapt
+                break;
+            }
+            // a job bigger than the whole budget gets it to itself
+            if ((held[head->type] + head->units <= limit || !held[head->type]) && grant(s, *head)) {
+                granted = true;
+            } else {
+                blocked = true;
+            }
+        }
+        if (granted)
+            continue;
+        if (blocked && !reclaimed && reclaim(s, false)) {
+            reclaimed = true;
+            continue;
+        }
+        break;
+    }
+}
+
+int SlotBroker::acquire(Client::Slot::Type type, size_t limit, bool wait, const std::string &what, size_t units)
+{
+    Shared *s = shared();
+    if (!s)
+        return NoLease;
+
+    Waiter *waiter = nullptr;
+    {
+        Locker lock;
+        const uint32_t self = owner(s);
+        if (!self)
+            return NoLease;
+        for (Waiter &w : s->waiters) {
+            if (!w.pid) {
+                waiter = &w;
+                break;
+            }
+        }
+        if (!waiter) {
+            ERROR("Too many processes waiting for %s slots", Client::Slot::typeToString(type));
+            return NoLease;
+        }
+        // everyone queues, tryAcquire() too, so no one gets ahead of the
+        // processes that are already waiting
+        waiter->pid = getpid();
+        waiter->owner = self;
+        waiter->type = type;
+        waiter->priority = Client::priority();
+        waiter->units = units;
+        waiter->limit = limit;
+        waiter->cap = Config::backgroundSlots;
+        waiter->granted = 0;
+        waiter->ticket = ++s->nextTicket;
+        waiter->since = Client::mono();
+        copyWhat(waiter->what, what.c_str());
+        dispatch(s);
+        const uint32_t granted = waiter->granted;
+        if (granted || !wait) {
+            memset(waiter, 0, sizeof(Waiter));
+            return granted ? static_cast<int>(granted - 1) : Busy;
+        }
+    }
+
+    while (true) {
+        waitFor(&waiter->granted);
+        Locker lock;
+        if (!__atomic_load_n(&waiter->granted, __ATOMIC_ACQUIRE))
+            dispatch(s); // picks up slots from processes that died
+        if (const uint32_t granted = waiter->granted) {
+            memset(waiter, 0, sizeof(Waiter));
+            return static_cast<int>(granted - 1);
+        }
+        if (!mine(waiter->owner)) {
+            // someone wiped the file
+            return NoLease;
+        }
+    }
+}
+
+void SlotBroker::release(int lease)
+{
+    Shared *s = shared();
+    if (!s || lease < 0 || lease >= MaxLeases)
+        return;
+    Locker lock;
+    if (s->leases[lease].pid && mine(s->leases[lease].owner)) {
+        memset(&s->leases[lease], 0, sizeof(Lease));
+        dispatch(s);
+    }
+}
+
+void SlotBroker::resize(int lease, size_t units)
+{
+    Shared *s = shared();
+    if (!s || lease < 0 || lease >= MaxLeases)
+        return;
+    Locker lock;
+    Lease &l = s->leases[lease];
+    if (!l.pid || !mine(l.owner))
+        return;
+    const uint64_t old = l.units;
+    l.units = units;
+    if (l.type == Client::Slot::Memory)
+        s->averageBytes = s->averageBytes ? s->averageBytes + (static_cast<int64_t>(units) - static_cast<int64_t>(s->averageBytes)) / 16 : units;
+    if (units < old)
+        dispatch(s);
+}
+
+size_t SlotBroker::expectedBytes()
+{
+    Shared *s = shared();
+    return s && s->averageBytes ? s->averageBytes : DefaultExpectedBytes;
+}
+
+void SlotBroker::releaseAll()
+{
+    if (!sShared)
+        return;
+    Locker lock;
+    bool released = false;
+    for (Lease &lease : sShared->leases) {
+        if (lease.pid && mine(lease.owner)) {
+            memset(&lease, 0, sizeof(lease));
+            released = true;
+        }
+    }
+    for (Waiter &waiter : sShared->waiters) {
+        if (waiter.pid && mine(waiter.owner))
+            memset(&waiter, 0, sizeof(waiter));
+    }
+    if (released)
+        dispatch(sShared);
+}
+
+void SlotBroker::dump(FILE *f)
+{
+    Shared *s = shared();
+    if (!s) {
+        fprintf(f, "No slots file\n");
+        return;
+    }
+    Locker lock;
+    reclaim(s, true);
+    const unsigned long long now = Client::mono();
+    for (Client::Slot::Type type : { Client::Slot::Compile, Client::Slot::Cpp, Client::Slot::DesiredCompile, Client::Slot::Memory }) {
+        size_t held = 0, background = 0;
+        for (const Lease &lease : s->leases) {
+            if (lease.pid && lease.type == static_cast<uint32_t>(type)) {
+                held += lease.units;
+                if (lease.priority == Client::Background)
+                    ++background;
+            }
+        }
+        const bool memory = type == Client::Slot::Memory;
+        const size_t limit = memory ? Resources::memoryBudget(Client::Slot::slots(type), held) : Client::Slot::slots(type);
+        fprintf(f, "%s %zu/%zu%s", Client::Slot::typeToString(type), held, limit, memory ? " bytes" : "");
+        if (background && !memory)
+            fprintf(f, " (%zu background)", background);
+        fprintf(f, "\n");
+        for (const Lease &lease : s->leases) {
+            if (!lease.pid || lease.type != static_cast<uint32_t>(type))
+                continue;
+            if (memory) {
+                fprintf(f, "    %d %s %llu bytes held for %llums (%s)\n", lease.pid, lease.what,
+                        static_cast<unsigned long long>(lease.units), now - lease.acquired,
+                        Client::priorityToString(static_cast<Client::Priority>(lease.priority)));
+            } else {
+                fprintf(f, "    %d %s held for %llums (%s)\n", lease.pid, lease.what, now - lease.acquired,
+                        Client::priorityToString(static_cast<Client::Priority>(lease.priority)));
+            }
+        }
+        std::vector<const Waiter *> waiters;
+        for (const Waiter &waiter : s->waiters) {
+            if (waiter.pid && waiter.type == static_cast<uint32_t>(type))
+                waiters.push_back(&waiter);
+        }
+        // in the order they'll get slots, cap aside
+        std::sort(waiters.begin(), waiters.end(), [](const Waiter *a, const Waiter *b) {
+                return a->priority > b->priority || (a->priority == b->priority && a->ticket < b->ticket);
+            });
+        for (const Waiter *waiter : waiters) {
+            fprintf(f, "    %d %s waiting for %llums (%s)\n", waiter->pid, waiter->what, now - waiter->since,
+                    Client::priorityToString(static_cast<Client::Priority>(waiter->priority)));
+        }
+    }
+}
+
+bool SlotBroker::clean()
+{
+    const std::string path = Config::slotsFile;
+    if (::unlink(path.c_str()) && errno != ENOENT) {
+        fprintf(stderr, "Failed to unlink %s: %d %s\n", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
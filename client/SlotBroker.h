@@ -0,0 +1,42 @@
+#ifndef SLOTBROKER_H
+#define SLOTBROKER_H
+
+#include "Client.h"
+#include <cstdio>
+
+// The local slots are leases in a file that every fiskc on the machine
+// maps (slots-file). Each lease records its owner, a byte range lock the
+// holding process has on the file, so slots held by a process that died
+// without releasing them are reclaimed by the next process that has to
+// wait for one. Processes that have to wait queue up
+// and slots are handed to them in the order they asked, higher priority
+// classes first (see Client::priority()), a release wakes the waiter that
+// got the slot rather than everyone. Background jobs can also be limited
+// to background-slots compile or preprocess slots. Memory is handed out
+// the same way except that a lease is a number of bytes out of a budget
+// rather than one slot. The file is guarded by flock(2) which the kernel
+// drops when a process dies, so a crash can't wedge it either.
+namespace SlotBroker {
+enum {
+    NoLease = -1, // no broker, the caller gets an unlimited slot
+    Busy = -2 // tryAcquire() and no slot was free
+};
+// limit is the caller's idea of how many slots of this type there are (or
+// bytes of memory, 0 for the automatic budget), what is shown by
+// --fisk-dump-semaphores. Memory leases are for units bytes, everything
+// else takes one.
+int acquire(Client::Slot::Type type, size_t limit, bool wait, const std::string &what, size_t units = 1);
+void release(int lease);
+// changes what a memory lease accounts for to what was actually used, this
+// never waits
+void resize(int lease, size_t units);
+// the average size of the preprocessed output of recent jobs
+size_t expectedBytes();
+// called at exit, leases of a process that's gone would be reclaimed
+// eventually but this hands them out right away
+void releaseAll();
+void dump(FILE *f);
+bool clean();
+}
+
+#endif /* SLOTBROKER_H */
@@ -0,0 +1,306 @@
+#include "Speculation.h"
+#include "CompilerArgs.h"
+#include "Config.h"
+#include "CostModel.h"
+#include "Log.h"
+#include "SlotBroker.h"
+#include "Watchdog.h"
+#include <climits>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+// The local compile has its own process group so a Ctrl-C on the terminal
+// doesn't reach it, when we're interrupted or killed it's killed from here
+static volatile sig_atomic_t sChild = 0;
+static char sTempOutput[PATH_MAX];
+
+static void signalHandler(int signal)
+{
+    if (sChild > 0)
+        ::kill(-sChild, SIGKILL);
+    if (*sTempOutput)
+        ::unlink(sTempOutput);
+    ::signal(signal, SIG_DFL);
+    ::raise(signal);
+}
+
+#ifdef __linux__
+// in the child that waits for the compiler, see start()
+static void parentDied(int)
+{
+    if (*sTempOutput)
+        ::unlink(sTempOutput);
+    ::kill(0, SIGKILL);
+}
+#endif
+
+// flags that make the compiler write files we wouldn't know to move into
+// place
+static bool hasSideOutputs(const std::vector<std::string> &args)
+{
+    static const char *prefixes[] = {
+        "-save-temps", "-gsplit-dwarf", "-ftime-trace", "-fdump-", "--coverage",
+        "-ftest-coverage", "-fprofile-arcs", "-fstack-usage", "-fcallgraph-info"
+    };
+    for (const std::string &arg : args) {
+        for (const char *prefix : prefixes) {
+            if (!strncmp(arg.c_str(), prefix, strlen(prefix)))
+                return true;
+        }
+    }
+    return false;
+}
+
+static int tempFile()
+{
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/fiskc-XXXXXX";
+    const int fd = ::mkstemp(&path[0]);
+    if (fd != -1) {
+        ::unlink(path.c_str());
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+static void replay(int from, int to)
+{
+    if (::lseek(from, 0, SEEK_SET))
+        return;
+    char buf[16384];
+    ssize_t r;
+    while ((r = ::read(from, buf, sizeof(buf))) > 0 || (r == -1 && errno == EINTR)) {
+        const char *ptr = buf;
+        while (r > 0) {
+            const ssize_t w = ::write(to, ptr, r);
+            if (w == -1) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            ptr += w;
+            r -= w;
+        }
+    }
+}
+
+bool Speculation::start(Client::Preprocessed *preprocessed)
+{
+    const Client::Data &data = Client::data();
+    const std::shared_ptr<CompilerArgs> &args = data.compilerArgs;
+    if (!Config::speculate || !args || hasSideOutputs(args->commandLine))
+        return false;
+
+    // the dependency file is written by the preprocess step so all we want
+    // from this one is the object file
+    std::vector<std::string> commandLine;
+    commandLine.reserve(args->commandLine.size());
+    commandLine.push_back(data.compiler);
+    for (size_t i=1; i<args->commandLine.size(); ++i) {
+        const std::string &arg = args->commandLine[i];
+        if (arg == "-o" && i + 1 < args->commandLine.size()) {
+            mOutput = args->commandLine[++i];
+        } else if (arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+        } else if (arg != "-MD" && arg != "-MMD" && arg != "-MP") {
+            commandLine.push_back(arg);
+        }
+    }
+    if (mOutput.empty())
+        return false;
+    // the winner's output is renamed into place, that mustn't replace
+    // /dev/null or a FIFO
+    struct stat st;
+    if (!::stat(mOutput.c_str(), &st) && !S_ISREG(st.st_mode))
+        return false;
+    mTempOutput = Client::format("%s.fisk-%d.tmp", mOutput.c_str(), getpid());
+    if (mTempOutput.size() >= sizeof(sTempOutput))
+        return false;
+    commandLine.push_back("-o");
+    commandLine.push_back(mTempOutput);
+
+    mSlot = Client::tryAcquireSlot(Client::Slot::Compile);
+    if (!mSlot) {
+        DEBUG("No compile slot free, not speculating");
+        return false;
+    }
+
+    int pipes[2];
+    mStdOut = tempFile();
+    mStdErr = tempFile();
+    if (mStdOut == -1 || mStdErr == -1 || ::pipe(pipes)) {
+        ERROR("Failed to set up speculative compile: %d %s", errno, strerror(errno));
+        reset();
+        return false;
+    }
+    for (int fd : pipes)
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Client::setFlag(pipes[0], O_NONBLOCK);
+
+    // built before forking, the child only makes async signal safe calls
+    std::vector<char *> argv;
+    for (const std::string &arg : commandLine)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    static bool installed = false;
+    if (!installed) {
+        installed = true;
+        for (int signal : { SIGINT, SIGHUP, SIGTERM, SIGQUIT })
+            ::signal(signal, signalHandler);
+    }
+    memcpy(sTempOutput, mTempOutput.c_str(), mTempOutput.size() + 1);
+
+    const pid_t parent = getpid();
+    mStarted = Client::mono();
+    mPid = fork();
+    if (mPid == 0) {
+        // its own process group so cancel() gets cc1 and friends as well
+        ::setpgid(0, 0);
+        ::dup2(mStdOut, STDOUT_FILENO);
+        ::dup2(mStdErr, STDERR_FILENO);
+        // the write end is inherited by the compiler and closes when it exits
+        ::fcntl(pipes[1], F_SETFD, 0);
+#ifdef __linux__
+        // A SIGKILL can't be caught so for when we get one this process
+        // stays around while the compiler runs and is told when we die. It
+        // then takes the temp output and the whole group, cc1 and as as
+        // well, down with it.
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = parentDied;
+        ::sigaction(SIGTERM, &act, nullptr);
+        ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (::getppid() != parent)
+            parentDied(SIGTERM);
+        const pid_t compiler = fork();
+        if (compiler == 0) {
+            ::execv(argv[0], argv.data());
+            _exit(101);
+        }
+        ::close(pipes[1]);
+        int status = 0;
+        while (compiler > 0 && ::waitpid(compiler, &status, 0) == -1 && errno == EINTR);
+        if (compiler > 0 && WIFEXITED(status))
+            _exit(WEXITSTATUS(status));
+        if (compiler > 0) {
+            ::signal(WTERMSIG(status), SIG_DFL);
+            ::kill(getpid(), WTERMSIG(status));
+        }
+#else
+        (void)parent;
+        ::execv(argv[0], argv.data());
+#endif
+        _exit(101);
+    }
+    ::close(pipes[1]);
+    if (mPid == -1) {
+        ERROR("Failed to fork: %d %s", errno, strerror(errno));
+        ::close(pipes[0]);
+        reset();
+        return false;
+    }
+    ::setpgid(mPid, mPid);
+    sChild = mPid;
+    mPipe = pipes[0];
+    mPreprocessed = preprocessed;
+    DEBUG("Started speculative local compile %d for %s", mPid, mOutput.c_str());
+    return true;
+}
+
+void Speculation::onRead()
+{
+    char buf[16];
+    ssize_t r;
+    while ((r = ::read(mPipe, buf, sizeof(buf))) > 0 || (r == -1 && errno == EINTR));
+    if (!r)
+        finish("speculative local compile finished first");
+}
+
+void Speculation::finish(const std::string &reason)
+{
+    if (mPid <= 0)
+        return;
+    int status;
+    pid_t ret;
+    while ((ret = ::waitpid(mPid, &status, 0)) == -1 && errno == EINTR);
+    const unsigned long long duration = Client::mono() - mStarted;
+    sChild = 0;
+    mPid = -1;
+    if (ret == -1 || !WIFEXITED(status)) {
+        DEBUG("Speculative local compile didn't finish, waiting for the slave");
+        ::unlink(mTempOutput.c_str());
+        reset();
+        return;
+    }
+
+    const int exitCode = WEXITSTATUS(status);
+    if (!exitCode && ::rename(mTempOutput.c_str(), mOutput.c_str())) {
+        ERROR("Failed to rename %s to %s: %d %s", mTempOutput.c_str(), mOutput.c_str(), errno, strerror(errno));
+        ::unlink(mTempOutput.c_str());
+        reset();
+        return;
+    }
+    ::unlink(mTempOutput.c_str());
+    *sTempOutput = '\0';
+
+    Client::Data &data = Client::data();
+    if (data.watchdog) {
+        data.watchdog->stop();
+        data.watchdog->save();
+    }
+    // the compile is done, preprocessing can be waiting for memory held by
+    // processes that are waiting for this slot
+    mSlot.reset();
+    if (mPreprocessed) {
+        mPreprocessed->wait(); // for the dependency file
+        if (!exitCode && !mPreprocessed->exitStatus)
+            CostModel::addLocal(mPreprocessed->size(), duration);
+    }
+    DEBUG("Speculative local compile won (%d)", exitCode);
+    Client::dumpPhases();
+    fflush(stdout);
+    fflush(stderr);
+    replay(mStdOut, STDOUT_FILENO);
+    replay(mStdErr, STDERR_FILENO);
+    data.exitCode = exitCode;
+    Client::writeTrace(reason);
+    mSlot.reset();
+    SlotBroker::releaseAll();
+    Client::OutputFile::abortAll();
+    _exit(exitCode);
+}
+
+void Speculation::cancel()
+{
+    if (mPid <= 0)
+        return;
+    DEBUG("Cancelling speculative local compile %d", mPid);
+    ::kill(-mPid, SIGKILL);
+    while (::waitpid(mPid, nullptr, 0) == -1 && errno == EINTR);
+    sChild = 0;
+    mPid = -1;
+    ::unlink(mTempOutput.c_str());
+    reset();
+}
+
+void Speculation::reset()
+{
+    for (int *fd : { &mPipe, &mStdOut, &mStdErr }) {
+        if (*fd != -1) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    mPid = -1;
+    sChild = 0;
+    *sTempOutput = '\0';
+    mSlot.reset();
+    mPreprocessed = nullptr;
+}
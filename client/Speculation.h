@@ -0,0 +1,62 @@
+#ifndef SPECULATION_H
+#define SPECULATION_H
+
+#include "Client.h"
+#include "Select.h"
+#include <string>
+#include <sys/types.h>
+
+// With --fisk-speculate a local compile is raced against the remote job
+// whenever a compile slot is free. Its object file goes to a temp file next
+// to the real one and its stdout/stderr to unlinked temp files so the loser
+// leaves nothing behind. The dependency file comes from our preprocess
+// step, same as for remote jobs.
+//
+// If the local compile exits first finish() moves its output into place
+// and exits the process from inside Select::exec(), the same way
+// runLocal() does. If the slave wins main cancels it. While it's running
+// acquireSlot(Compile) hands out its slot and runLocal() waits for it
+// rather than starting another compile. If fiskc is interrupted or
+// terminated the local compile is killed and its temp file removed. On
+// Linux the forked child waits for the compiler rather than exec it so it
+// can do the same when fiskc is killed outright.
+class Speculation : public Socket
+{
+public:
+    Speculation() {}
+    ~Speculation() { cancel(); }
+
+    bool start(Client::Preprocessed *preprocessed);
+    bool isRunning() const { return mPid > 0; }
+    // kills the local compile, its slot is released
+    void cancel();
+    // Waits for the local compile if needed, moves its output into place,
+    // replays its stdout/stderr and exits with its exit code. Returns if it
+    // didn't exit normally, in which case nothing was touched.
+    void finish(const std::string &reason);
+    std::unique_ptr<Client::Slot> takeSlot() { return std::move(mSlot); }
+
+protected:
+    virtual int fd() const override { return mPid > 0 ? mPipe : -1; }
+    virtual unsigned int mode() const override { return mPid > 0 ? Read : None; }
+    virtual void onWrite() override {}
+    virtual void onRead() override;
+    virtual void onTimeout() override {}
+    virtual int timeout() override { return -1; }
+
+private:
+    Speculation(const Speculation &) = delete;
+    Speculation &operator=(const Speculation &) = delete;
+
+    void reset();
+
+    pid_t mPid { -1 };
+    unsigned long long mStarted { 0 };
+    int mPipe { -1 }; // hits EOF once the compiler exits
+    int mStdOut { -1 }, mStdErr { -1 };
+    std::string mOutput, mTempOutput;
+    std::unique_ptr<Client::Slot> mSlot;
+    Client::Preprocessed *mPreprocessed { nullptr };
+};
+
+#endif /* SPECULATION_H */
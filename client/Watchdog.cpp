@@ -2,6 +2,40 @@
 #include "Config.h"
 #include "Client.h"
 #include "Log.h"
+#include <sys/file.h>
+#include <unistd.h>
+
+// The history is a histogram of how long each stage took, shared by all
+// fiskc processes using the same cache dir. Bucket i holds durations up to
+// bucketLimit(i) ms, limits go 2, 3, 4, 6, 8, 12... so the percentiles are
+// within 50% of the real ones. Once a stage has MaxSamples samples all its
+// buckets are halved so old jobs fade out.
+enum {
+    HistoryMagic = 0x31485746, // FWH1
+    BucketCount = 40,
+    MinSamples = 32,
+    MaxSamples = 1024,
+    Factor = 3
+};
+
+struct History
+{
+    uint32_t magic;
+    uint32_t counts[Watchdog::Finished][BucketCount];
+};
+
+static inline unsigned long long bucketLimit(size_t bucket)
+{
+    return bucket & 1 ? 3ull << (bucket / 2) : 2ull << (bucket / 2);
+}
+
+static inline size_t bucket(unsigned long long duration)
+{
+    size_t ret = 0;
+    while (ret < BucketCount - 1 && duration > bucketLimit(ret))
+        ++ret;
+    return ret;
+}
 
 Watchdog::Watchdog()
     : mState(Config::watchdog ? Running : Stopped)
@@ -16,8 +50,12 @@ void Watchdog::transition(Stage stage)
     Watchdog::timings[stage] = Client::mono();
     std::unique_lock<std::mutex> lock(Client::mutex());
     DEBUG("Watchdog transition from %s to %s (stage took %llu)", stageName(mStage), stageName(stage), Watchdog::timings[stage] - Watchdog::timings[stage - 1]);
+    // measured from the last restart(), not from the previous stage
+    mDurations[mStage] = Watchdog::timings[stage] - mTransitionTime;
     mStage = stage;
     mTransitionTime = Client::mono();
+    if (stage == Finished)
+        save();
 }
 
 void Watchdog::stop()
@@ -30,47 +68,141 @@ int Watchdog::timeout()
 {
     if (mState != Running)
         return -1;
+    if (!mHistoryLoaded)
+        loadHistory();
     const unsigned long long now = Client::mono();
-    mTimeoutTime = mTransitionTime;
+    if (mStage == Finished)
+        return -1;
+    mTimeoutTime = mTransitionTime + stageTimeout();
+    if (now >= mTimeoutTime) {
+        DEBUG("Already timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
+        return 0;
+    }
+    DEBUG("Setting watchdog timeout to %llu (%llu/%llu) waiting for %s",
+          mTimeoutTime - now,
+          mTimeoutTime, now,
+          stageName(static_cast<Stage>(mStage + 1)));
+    return mTimeoutTime - now;
+}
+
+void Watchdog::onTimeout()
+{
+    if (mState == Running && Client::mono() >= mTimeoutTime) {
+        ERROR("Watchdog timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
+        // the stage took at least this long, recording it lets the timeout
+        // grow again if it was learned from a faster period. Not longer
+        // than the timeout though, however late we got to run this.
+        mDurations[mStage] = std::min(Client::mono() - mTransitionTime, stageTimeout());
+        mTimedOut = true;
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), Client::format("timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1))).c_str());
+    }
+}
+
+unsigned long long Watchdog::stageTimeout() const
+{
+    unsigned long long configured = 0;
     switch (mStage) {
     case Initial:
-        mTimeoutTime += Config::schedulerConnectTimeout;
+        configured = Config::schedulerConnectTimeout;
         break;
     case ConnectedToScheduler:
-        mTimeoutTime += Config::acquiredSlaveTimeout;
+        configured = Config::acquiredSlaveTimeout;
         break;
     case AcquiredSlave:
-        mTimeoutTime += Config::slaveConnectTimeout;
+        configured = Config::slaveConnectTimeout;
         break;
     case ConnectedToSlave:
-        mTimeoutTime += Config::preprocessTimeout;
+        configured = Config::preprocessTimeout;
         break;
     case PreprocessFinished:
-        mTimeoutTime += Config::uploadJobTimeout;
+        configured = Config::uploadJobTimeout;
         break;
     case UploadedJob:
-        mTimeoutTime += Config::responseTimeout;
-        break;
+        // restarted by heartbeats so how long the stage takes says nothing
+        // about how long we should wait for the next one
+        return Config::responseTimeout;
     case Finished:
-        return -1;
+        break;
     }
-    if (now >= mTimeoutTime) {
-        DEBUG("Already timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
-        return 0;
+    if (!mLearned[mStage])
+        return configured;
+    // what's configured is the most we wait
+    return std::min(configured, std::max(configured / 4, mLearned[mStage] * Factor));
+}
+
+void Watchdog::loadHistory()
+{
+    mHistoryLoaded = true;
+    if (!Config::adaptiveTimeouts)
+        return;
+    const std::string path = Config::watchdogHistory();
+    if (path.empty())
+        return;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    History history;
+    const bool ok = ::pread(fd, &history, sizeof(history), 0) == sizeof(history) && history.magic == HistoryMagic;
+    ::close(fd);
+    if (!ok)
+        return;
+
+    for (size_t stage=Initial; stage<UploadedJob; ++stage) {
+        size_t total = 0;
+        for (size_t i=0; i<BucketCount; ++i)
+            total += history.counts[stage][i];
+        if (total < MinSamples)
+            continue;
+        // p99
+        const size_t wanted = total - total / 100;
+        size_t seen = 0;
+        for (size_t i=0; i<BucketCount; ++i) {
+            seen += history.counts[stage][i];
+            if (seen >= wanted) {
+                mLearned[stage] = bucketLimit(i);
+                break;
+            }
+        }
+        DEBUG("Learned p99 %llu for %s from %zu samples", mLearned[stage], stageName(static_cast<Stage>(stage + 1)), total);
     }
-    DEBUG("Setting watchdog timeout to %llu (%llu/%llu) waiting for %s",
-          mTimeoutTime - now,
-          mTimeoutTime, now,
-          stageName(static_cast<Stage>(mStage + 1)));
-    return mTimeoutTime - now;
 }
 
-void Watchdog::onTimeout()
+void Watchdog::save()
 {
-    if (mState == Running && Client::mono() >= mTimeoutTime) {
-        ERROR("Watchdog timed out waiting for %s", stageName(static_cast<Stage>(mStage + 1)));
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+    if (mSaved || (mStage == Initial && !mTimedOut) || !Config::adaptiveTimeouts)
+        return;
+    mSaved = true;
+    const std::string path = Config::watchdogHistory();
+    if (path.empty())
+        return;
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        DEBUG("Failed to open %s: %d %s", path.c_str(), errno, strerror(errno));
+        return;
+    }
+    if (::flock(fd, LOCK_EX)) {
+        ::close(fd);
+        return;
+    }
+    History history;
+    if (::pread(fd, &history, sizeof(history), 0) != sizeof(history) || history.magic != HistoryMagic) {
+        memset(&history, 0, sizeof(history));
+        history.magic = HistoryMagic;
+    }
+    for (size_t stage=Initial; stage<std::min<size_t>(mStage + (mTimedOut ? 1 : 0), UploadedJob); ++stage) {
+        uint32_t *counts = history.counts[stage];
+        ++counts[bucket(mDurations[stage])];
+        size_t total = 0;
+        for (size_t i=0; i<BucketCount; ++i)
+            total += counts[i];
+        if (total >= MaxSamples) {
+            for (size_t i=0; i<BucketCount; ++i)
+                counts[i] = (counts[i] + 1) / 2;
+        }
     }
+    if (::pwrite(fd, &history, sizeof(history), 0) != sizeof(history))
+        ERROR("Failed to write %s: %d %s", path.c_str(), errno, strerror(errno));
+    ::close(fd); // releases the lock
 }
 
 void Watchdog::heartbeat()
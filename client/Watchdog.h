@@ -37,8 +37,14 @@ public:
         assert(0);
         return "";
     }
+    Stage stage() const { return mStage; }
     void transition(Stage stage);
     void heartbeat();
+    // adds the durations of the stages that completed to the history the
+    // adaptive timeouts are derived from, only the first call does anything
+    void save();
+    // restarts the timer for the current stage
+    void restart() { mTransitionTime = Client::mono(); }
     void stop();
 protected:
     virtual int fd() const override { return -1; }
@@ -54,8 +60,17 @@ private:
         Stopped,
         Suspended
     } mState { Running };
+    unsigned long long stageTimeout() const;
+    void loadHistory();
+
     unsigned long long mTransitionTime { Client::mono() };
     unsigned long long mTimeoutTime { 0 };
+    unsigned long long mDurations[Finished] { 0 };
+    // 0 if there aren't enough samples for the stage
+    unsigned long long mLearned[Finished] { 0 };
+    bool mHistoryLoaded { false };
+    bool mSaved { false };
+    bool mTimedOut { false };
 };
 
 #endif /* WATCHDOG_H */
@@ -2,6 +2,7 @@
 #include "Log.h"
 #include "Watchdog.h"
 #include "Client.h"
+#include "Mask.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
@@ -14,6 +15,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+enum {
+    MaxBufferedSendData = 1024 * 1024,
+    MaxFramePayload = 64 * 1024,
+    MaxFrameHeader = 14
+};
+
 static inline std::string create_acceptkey(const std::string& clientkey)
 {
     std::string s = clientkey + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -47,24 +54,30 @@ WebSocket::WebSocket()
             wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
             return -1;
         }
-        const ssize_t ret = std::min<ssize_t>(ws->mRecvBuffer.size(), len);
-        memcpy(buf, &ws->mRecvBuffer[0], ret);
-        ws->mRecvBuffer.erase(ws->mRecvBuffer.begin(), ws->mRecvBuffer.begin() + ret);
-        return ret;
+        return ws->mRecvBuffer.read(buf, len);
     };
 
     mCallbacks.send_callback = [](wslay_event_context *ctx,
                                   const uint8_t *data, size_t len,
                                   int flags, void *user_data) -> ssize_t {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        ws->mSendBuffer.resize(ws->mSendBuffer.size() + len);
-        memcpy(&ws->mSendBuffer[ws->mSendBuffer.size() - len], data, len);
+        if (ws->mSendBuffer.size() >= MaxBufferedSendData) {
+            // leave the rest in wslay's queue until we've written this
+            wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
+            return -1;
+        }
+        ws->sendData(data, len);
+        if (ws->mState == Error) {
+            wslay_event_set_error(ctx, WSLAY_ERR_CALLBACK_FAILURE);
+            return -1;
+        }
         return len;
     };
     mCallbacks.genmask_callback = [](wslay_event_context *,
                                      uint8_t *buf, size_t len,
-                                     void *) -> int {
-        return random(buf, len) == len ? 0 : -1;
+                                     void *user_data) -> int {
+        WebSocket *ws = static_cast<WebSocket *>(user_data);
+        return ws->randomMask(buf, len) ? 0 : -1;
     };
     mCallbacks.on_msg_recv_callback = [](wslay_event_context *ctx,
                                          const struct wslay_event_on_msg_recv_arg *arg,
@@ -236,7 +249,7 @@ bool WebSocket::requestUpgrade()
         DEBUG("Sending headers:\n%s", reqHeader);
 
         assert(mSendBuffer.empty());
-        mSendBuffer = std::vector<unsigned char>(reqHeader, reqHeader + reqHeaderSize);
+        mSendBuffer.append(reqHeader, reqHeaderSize);
         mState = WaitingForUpgrade;
     }
     send();
@@ -246,15 +259,14 @@ bool WebSocket::requestUpgrade()
 void WebSocket::acceptUpgrade()
 {
     DEBUG("Accept upgrade %zu bytes", mRecvBuffer.size());
-    char *ch = reinterpret_cast<char *>(&mRecvBuffer[0]);
-    std::string headers;
-    for (size_t i=0; i<mRecvBuffer.size() - 3; ++i) {
-        if (!strncmp(ch, "\r\n\r\n", 4)) {
-            headers.assign(reinterpret_cast<char *>(&mRecvBuffer[0]), i + 4);
-            mRecvBuffer.erase(mRecvBuffer.begin(), mRecvBuffer.begin() + i + 4);
-            break;
-        }
-        ++ch;
+    std::string headers(mRecvBuffer.size(), ' ');
+    mRecvBuffer.copy(&headers[0], headers.size());
+    const size_t end = headers.find("\r\n\r\n");
+    if (end != std::string::npos) {
+        headers.resize(end + 4);
+        mRecvBuffer.consume(headers.size());
+    } else {
+        headers.clear();
     }
     if (!headers.empty()) {
         mHandshakeResponseHeaders = Client::split(headers, "\r\n");
@@ -291,20 +303,118 @@ void WebSocket::acceptUpgrade()
     onConected();
 }
 
-bool WebSocket::send(MessageType type, const void *msg, size_t len)
+bool WebSocket::send(MessageType type, const void *msg, size_t len, Ownership ownership)
 {
-    wslay_event_msg wmsg = {
-        static_cast<uint8_t>(type == Text ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME),
-        reinterpret_cast<const uint8_t *>(msg),
-        len
-    };
-    return !wslay_event_queue_msg(mContext, &wmsg) && !wslay_event_send(mContext);
+    if (mState != ConnectedWebSocket)
+        return false;
+    mOutgoing.emplace_back();
+    Outgoing &outgoing = mOutgoing.back();
+    outgoing.opcode = type == Text ? WSLAY_TEXT_FRAME : WSLAY_BINARY_FRAME;
+    if (ownership == Copy) {
+        outgoing.copy.assign(static_cast<const char *>(msg), len);
+        outgoing.data = reinterpret_cast<const unsigned char *>(outgoing.copy.c_str());
+    } else {
+        outgoing.data = static_cast<const unsigned char *>(msg);
+    }
+    outgoing.length = len;
+    outgoing.offset = 0;
+    sendFrames();
+    return mState == ConnectedWebSocket;
 }
 
 void WebSocket::close(const char *reason)
 {
-    wslay_event_queue_close(mContext, 1000, reinterpret_cast<const uint8_t *>(reason), reason ? strlen(reason) : 0);
-    wslay_event_send(mContext);
+    mClosePending = true;
+    mCloseReason = reason ? reason : "";
+    sendFrames();
+}
+
+void WebSocket::sendData(const void *data, size_t len)
+{
+    if (mSendBuffer.empty()) {
+        // nothing queued ahead of us, skip the copy if the socket takes it
+        ssize_t w;
+        do {
+            w = ::write(mFD, data, len);
+        } while (w == -1 && errno == EINTR);
+        if (w > 0) {
+            mBytesWritten += w;
+            data = static_cast<const unsigned char *>(data) + w;
+            len -= w;
+        } else if (w == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            mState = Error;
+            return;
+        }
+    }
+    if (len)
+        mSendBuffer.append(data, len);
+}
+
+void WebSocket::sendFrames()
+{
+    while (mState == ConnectedWebSocket && mSendBuffer.size() < MaxBufferedSendData) {
+        if (wslay_event_want_write(mContext)) {
+            // Control frames go first. If wslay is still stuck in the
+            // middle of a frame we can't start one of ours.
+            wslay_event_send(mContext);
+            if (wslay_event_want_write(mContext))
+                break;
+        }
+        if (mOutgoing.empty()) {
+            if (mClosePending) {
+                mClosePending = false;
+                wslay_event_queue_close(mContext, 1000, reinterpret_cast<const uint8_t *>(mCloseReason.c_str()), mCloseReason.size());
+                wslay_event_send(mContext);
+            }
+            break;
+        }
+
+        Outgoing &outgoing = mOutgoing.front();
+        const size_t payload = std::min<size_t>(outgoing.length - outgoing.offset, MaxFramePayload);
+        const bool first = !outgoing.offset;
+        const bool last = outgoing.offset + payload == outgoing.length;
+        if (mFrame.empty())
+            mFrame.resize(MaxFrameHeader + MaxFramePayload);
+        unsigned char *frame = &mFrame[0];
+        size_t header = 0;
+        frame[header++] = (last ? 0x80 : 0x0) | (first ? outgoing.opcode : WSLAY_CONTINUATION_FRAME);
+        if (payload < 126) {
+            frame[header++] = 0x80 | payload;
+        } else if (payload <= 0xffff) {
+            frame[header++] = 0x80 | 126;
+            frame[header++] = payload >> 8;
+            frame[header++] = payload & 0xff;
+        } else {
+            frame[header++] = 0x80 | 127;
+            for (int shift=56; shift>=0; shift -= 8)
+                frame[header++] = (static_cast<unsigned long long>(payload) >> shift) & 0xff;
+        }
+        unsigned char *mask = frame + header;
+        if (!randomMask(mask, 4)) {
+            mState = Error;
+            break;
+        }
+        header += 4;
+        Mask::apply(frame + header, outgoing.data + outgoing.offset, payload, mask);
+        sendData(frame, header + payload);
+        outgoing.offset += payload;
+        if (last)
+            mOutgoing.pop_front();
+    }
+}
+
+bool WebSocket::randomMask(unsigned char *mask, size_t len)
+{
+    if (len > sizeof(mMaskPool))
+        return random(mask, len) == len;
+    if (mMaskPoolOffset + len > sizeof(mMaskPool)) {
+        if (random(mMaskPool, sizeof(mMaskPool)) != sizeof(mMaskPool))
+            return false;
+        mMaskPoolOffset = 0;
+    }
+    memcpy(mask, mMaskPool + mMaskPoolOffset, len);
+    mMaskPoolOffset += len;
+    return true;
 }
 
 unsigned int WebSocket::mode() const
@@ -326,7 +436,7 @@ unsigned int WebSocket::mode() const
         break;
     case ConnectedWebSocket:
         ret |= Read;
-        if (wslay_event_want_write(mContext) || !mSendBuffer.empty())
+        if (wslay_event_want_write(mContext) || !mSendBuffer.empty() || !mOutgoing.empty() || mClosePending)
             ret |= Write;
         break;
     }
@@ -357,20 +467,20 @@ void WebSocket::onWrite()
             return;
     }
     send();
+    if (mState == ConnectedWebSocket)
+        sendFrames();
 }
 
 void WebSocket::onRead()
 {
-    const bool sendBufferWasEmpty = mSendBuffer.empty();
     while (true) {
-        char buf[BUFSIZ];
-        const ssize_t r = ::read(mFD, buf, sizeof(buf));
+        const ssize_t r = mRecvBuffer.readFrom(mFD);
         DEBUG("Read %zd bytes", r);
         if (!r) {
             mState = Closed;
             break;
         } else if (r > 0) {
-            mRecvBuffer.insert(mRecvBuffer.end(), buf, buf + r);
+            continue;
         } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
             break;
         } else {
@@ -393,20 +503,17 @@ void WebSocket::onRead()
                 break;
         }
 
-        if (sendBufferWasEmpty && !mSendBuffer.empty())
-            send();
-        wslay_event_send(mContext);
+        sendFrames();
     }
 }
 
 void WebSocket::send()
 {
-    size_t sendBufferOffset = 0;
-    while (sendBufferOffset < mSendBuffer.size()) {
-        const ssize_t r = ::write(mFD, &mSendBuffer[sendBufferOffset], std::min<size_t>(BUFSIZ, mSendBuffer.size() - sendBufferOffset));
+    while (!mSendBuffer.empty()) {
+        const ssize_t r = mSendBuffer.writeTo(mFD);
         DEBUG("Wrote %zd bytes\n", r);
         if (r > 0) {
-            sendBufferOffset += r;
+            mBytesWritten += r;
         } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
             break;
         } else {
@@ -414,7 +521,4 @@ void WebSocket::send()
             break;
         }
     }
-    if (sendBufferOffset) {
-        mSendBuffer.erase(mSendBuffer.begin(), mSendBuffer.begin() + sendBufferOffset);
-    }
 }
@@ -1,11 +1,13 @@
 #ifndef WEBSOCKET_H
 #define WEBSOCKET_H
 
+#include <deque>
 #include <functional>
 #include <string>
 #include <vector>
 #include <map>
 #include <wslay/wslay.h>
+#include "RingBuffer.h"
 #include "Select.h"
 #include <LUrlParser.h>
 
@@ -20,9 +22,16 @@ public:
         Binary
     };
     bool connect(std::string &&url, const std::map<std::string, std::string> &headers);
-    bool send(MessageType mode, const void *data, size_t len);
+    // Borrow leaves data with the caller, it has to stay valid until
+    // hasPendingSendData() returns false and it's read as it goes out.
+    enum Ownership {
+        Copy,
+        Borrow
+    };
+    bool send(MessageType mode, const void *data, size_t len, Ownership ownership = Copy);
     void close(const char *reason);
-    bool hasPendingSendData() const { return !mSendBuffer.empty(); }
+    bool hasPendingSendData() const { return !mSendBuffer.empty() || !mOutgoing.empty() || (mContext && wslay_event_want_write(mContext)); }
+    unsigned long long bytesWritten() const { return mBytesWritten; }
     enum State {
         Error = -2,
         Closed = -1,
@@ -64,15 +73,33 @@ private:
     bool requestUpgrade();
     void acceptUpgrade();
     void send();
+    void sendData(const void *data, size_t len);
+    void sendFrames();
+    bool randomMask(unsigned char *mask, size_t len);
     std::string mUrl, mHost, mClientKey;
     int mPort { -1 };
     LUrlParser::clParseURL mParsedUrl;
     std::map<std::string, std::string> mHeaders;
     int mFD { -1 };
+    unsigned long long mBytesWritten { 0 };
     wslay_event_callbacks mCallbacks { 0 };
     wslay_event_context *mContext { 0 };
 
-    std::vector<unsigned char> mRecvBuffer, mSendBuffer;
+    RingBuffer mRecvBuffer, mSendBuffer;
+    // Data messages are framed and masked by us, wslay only sends control
+    // frames
+    struct Outgoing {
+        unsigned char opcode;
+        std::string copy;
+        const unsigned char *data;
+        size_t length, offset;
+    };
+    std::deque<Outgoing> mOutgoing;
+    std::vector<unsigned char> mFrame;
+    bool mClosePending { false };
+    std::string mCloseReason;
+    unsigned char mMaskPool[256];
+    size_t mMaskPoolOffset { sizeof(mMaskPool) };
     std::vector<std::string> mHandshakeResponseHeaders;
     State mState { None };
 };
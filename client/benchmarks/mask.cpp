@@ -0,0 +1,69 @@
+#include "Mask.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Compares the byte at a time loop wslay uses with Mask::applyScalar and
+// Mask::apply for a few message sizes. Run as mask-benchmark [megabytes].
+
+static void bytewise(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char mask[4], size_t offset)
+{
+    for (size_t i=0; i<len; ++i)
+        dst[i] = src[i] ^ mask[(offset + i) % 4];
+}
+
+typedef void (*Function)(unsigned char *, const unsigned char *, size_t, const unsigned char *, size_t);
+
+static double run(Function function, unsigned char *dst, const unsigned char *src, size_t size, size_t total)
+{
+    const unsigned char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    const auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+    while (done < total) {
+        function(dst, src, size, mask, 0);
+        done += size;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return done / elapsed.count() / (1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv)
+{
+    const size_t total = (argc > 1 ? strtoull(argv[1], 0, 10) : 1024) * 1024 * 1024;
+    const struct {
+        const char *name;
+        Function function;
+    } functions[] = {
+        { "bytewise", bytewise },
+        { "scalar", Mask::applyScalar },
+        { "apply", Mask::apply }
+    };
+    const size_t sizes[] = { 125, 4096, 65536, 1024 * 1024 };
+    std::vector<unsigned char> src(1024 * 1024 + 1), dst(src.size());
+    for (size_t i=0; i<src.size(); ++i)
+        src[i] = static_cast<unsigned char>(rand());
+
+    // make sure they agree, also for unaligned buffers and offsets
+    const unsigned char mask[4] = { 0xde, 0xad, 0xbe, 0xef };
+    std::vector<unsigned char> expected(src.size());
+    for (size_t offset=0; offset<4; ++offset) {
+        bytewise(&expected[1], &src[1], 100003, mask, offset);
+        for (const auto &function : functions) {
+            function.function(&dst[1], &src[1], 100003, mask, offset);
+            if (memcmp(&dst[1], &expected[1], 100003)) {
+                fprintf(stderr, "%s produced the wrong result\n", function.name);
+                return 1;
+            }
+        }
+    }
+
+    for (size_t size : sizes) {
+        printf("%8zu bytes:", size);
+        for (const auto &function : functions)
+            printf(" %s %.0f MB/s", function.name, run(function.function, &dst[1], &src[1], size, total));
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <openssl/sha.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <map>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Runs fiskc against a stub scheduler that accepts the websocket handshake
+// and then hangs up so fiskc falls back to building locally, and reports
+// the per phase numbers fiskc prints with --fisk-profile-startup. Run as
+// startup-benchmark <fiskc> [runs] [compiler].
+
+static std::string base64(const unsigned char *in, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string ret;
+    for (size_t i=0; i<len; i += 3) {
+        const unsigned int chunk = (in[i] << 16) | (i + 1 < len ? in[i + 1] << 8 : 0) | (i + 2 < len ? in[i + 2] : 0);
+        ret += alphabet[(chunk >> 18) & 0x3f];
+        ret += alphabet[(chunk >> 12) & 0x3f];
+        ret += i + 1 < len ? alphabet[(chunk >> 6) & 0x3f] : '=';
+        ret += i + 2 < len ? alphabet[chunk & 0x3f] : '=';
+    }
+    return ret;
+}
+
+static void serve(int listener)
+{
+    while (true) {
+        const int fd = ::accept(listener, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            const ssize_t r = ::read(fd, buf, sizeof(buf));
+            if (r <= 0)
+                break;
+            request.append(buf, r);
+        }
+        std::string key;
+        const size_t idx = request.find("Sec-WebSocket-Key: ");
+        if (idx != std::string::npos)
+            key = request.substr(idx + 19, request.find("\r\n", idx) - idx - 19);
+        key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char sha[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const unsigned char *>(key.c_str()), key.size(), sha);
+        const std::string response = ("HTTP/1.1 101 Switching Protocols\r\n"
+                                      "Upgrade: websocket\r\n"
+                                      "Connection: Upgrade\r\n"
+                                      "Sec-WebSocket-Accept: " + base64(sha, sizeof(sha)) + "\r\n\r\n");
+        if (::write(fd, response.c_str(), response.size()) != static_cast<ssize_t>(response.size()))
+            perror("write");
+        ::close(fd);
+    }
+}
+
+// parses "fiskc startup: name=wall/cpu ..."
+static bool parse(const std::string &output, std::map<std::string, std::vector<std::pair<double, double> > > &samples)
+{
+    const size_t start = output.find("fiskc startup:");
+    if (start == std::string::npos)
+        return false;
+    size_t pos = start + 14;
+    const size_t end = output.find('\n', pos);
+    while (pos < end) {
+        while (pos < end && output[pos] == ' ')
+            ++pos;
+        const size_t eq = output.find('=', pos);
+        const size_t slash = output.find('/', eq);
+        size_t next = output.find(' ', slash);
+        if (eq == std::string::npos || slash == std::string::npos || eq > end || slash > end)
+            break;
+        if (next > end)
+            next = end;
+        const std::string name = output.substr(pos, eq - pos);
+        const std::string wall = output.substr(eq + 1, slash - eq - 1);
+        samples[name].push_back(std::make_pair(wall == "-" ? -1. : atof(wall.c_str()) / 1000.,
+                                               atof(output.substr(slash + 1, next - slash - 1).c_str()) / 1000.));
+        pos = next;
+    }
+    return true;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(values.size() * p))];
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <fiskc> [runs] [compiler]\n", argv[0]);
+        return 1;
+    }
+    const std::string fiskc = argv[1];
+    const size_t runs = argc > 2 ? strtoull(argv[2], 0, 10) : 50;
+    const char *compiler = argc > 3 ? argv[3] : "/usr/bin/cc";
+
+    signal(SIGPIPE, SIG_IGN);
+    const int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listener == -1
+        || ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))
+        || ::listen(listener, 128)
+        || ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addrLen)) {
+        perror("Failed to listen");
+        return 1;
+    }
+    std::thread(serve, listener).detach();
+
+    char dir[] = "/tmp/fisk-startup-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::string source = std::string(dir) + "/empty.c";
+    const std::string object = std::string(dir) + "/empty.o";
+    FILE *f = fopen(source.c_str(), "w");
+    if (!f) {
+        perror("fopen");
+        return 1;
+    }
+    fputs("int empty(void) { return 0; }\n", f);
+    fclose(f);
+
+    const std::string scheduler = "FISK_SCHEDULER=ws://127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    const std::string compilerEnv = std::string("FISK_COMPILER=") + compiler;
+    const std::string cacheDir = "FISK_CACHE_DIR=" + std::string(dir) + "/cache";
+    const std::string path = std::string("PATH=") + (getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    const std::string home = std::string("HOME=") + dir;
+
+    std::map<std::string, std::vector<std::pair<double, double> > > samples;
+    size_t failed = 0;
+    // the first run populates the caches and isn't counted
+    for (size_t run=0; run<=runs; ++run) {
+        int pipes[2];
+        if (::pipe(pipes)) {
+            perror("pipe");
+            return 1;
+        }
+        const pid_t pid = fork();
+        if (pid == 0) {
+            ::dup2(pipes[1], STDERR_FILENO);
+            ::close(pipes[0]);
+            ::close(pipes[1]);
+            const char *args[] = { fiskc.c_str(), "-c", source.c_str(), "-o", object.c_str(), nullptr };
+            const char *env[] = {
+                scheduler.c_str(), compilerEnv.c_str(), cacheDir.c_str(), path.c_str(), home.c_str(),
+                "FISK_PROFILE_STARTUP=1", "FISK_NO_DESIRE=1", "FISK_WATCHDOG=0", nullptr
+            };
+            ::execve(fiskc.c_str(), const_cast<char **>(args), const_cast<char **>(env));
+            perror("execve");
+            _exit(1);
+        }
+        ::close(pipes[1]);
+        std::string output;
+        char buf[4096];
+        ssize_t r;
+        while ((r = ::read(pipes[0], buf, sizeof(buf))) > 0 || (r == -1 && errno == EINTR)) {
+            if (r > 0)
+                output.append(buf, r);
+        }
+        ::close(pipes[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!run)
+            continue;
+        if (!parse(output, samples)) {
+            if (!failed++)
+                fprintf(stderr, "No startup profile from %s:\n%s\n", fiskc.c_str(), output.c_str());
+        }
+    }
+
+    printf("%zu runs (%zu without a profile), milliseconds\n", runs, failed);
+    printf("%-20s %10s %10s %10s %10s\n", "phase", "wall p50", "wall p90", "cpu p50", "cpu p90");
+    // fiskc's own order, total last
+    for (const char *name : { "pre-main", "config", "log", "compiler", "arguments", "environment", "scheduler-request", "scheduler-connect", "total" }) {
+        auto it = samples.find(name);
+        if (it == samples.end())
+            continue;
+        std::vector<double> wall, cpu;
+        for (const auto &sample : it->second) {
+            if (sample.first >= 0)
+                wall.push_back(sample.first);
+            cpu.push_back(sample.second);
+        }
+        if (wall.empty()) {
+            printf("%-20s %10s %10s %10.3f %10.3f\n", name, "-", "-", percentile(cpu, .5), percentile(cpu, .9));
+        } else {
+            printf("%-20s %10.3f %10.3f %10.3f %10.3f\n", name, percentile(wall, .5), percentile(wall, .9), percentile(cpu, .5), percentile(cpu, .9));
+        }
+    }
+
+    unlink(object.c_str());
+    unlink(source.c_str());
+    return 0;
+}
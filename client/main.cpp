@@ -1,23 +1,28 @@
 #include "Client.h"
 #include "CompilerArgs.h"
+#include "Compression.h"
 #include "Config.h"
+#include "CostModel.h"
+#include "Daemon.h"
+#include "Jobserver.h"
 #include "SlaveWebSocket.h"
 #include "SchedulerWebSocket.h"
+#include "Speculation.h"
 #include "Log.h"
+#include "ObjectCache.h"
 #include "Select.h"
+#include "SlotBroker.h"
 #include "Watchdog.h"
 #include "WebSocket.h"
 #include <json11.hpp>
 #include <climits>
 #include <cstdlib>
-#include <regex>
 #include <cstring>
 #include <unistd.h>
 #include <csignal>
+#include <semaphore.h>
 
 static const unsigned long long milliseconds_since_epoch = std::chrono::system_clock::now().time_since_epoch() / std::chrono::milliseconds(1);
-static unsigned long long preprocessedDuration = 0;
-static unsigned long long preprocessedSlotDuration = 0;
 int main(int argc, char **argv)
 {
     if (getenv("FISKC_INVOKED")) {
@@ -28,16 +33,14 @@ int main(int argc, char **argv)
     // usleep(500 * 1000);
     // return 0;
     std::atexit([]() {
+            Client::dumpPhases();
             const Client::Data &data = Client::data();
-            for (sem_t *semaphore : data.semaphores) {
-                if (!data.maintainSemaphores)
-                    sem_post(semaphore);
-                sem_close(semaphore);
-            }
+            SlotBroker::releaseAll();
+            Jobserver::acquire();
             if (Watchdog *watchdog = data.watchdog) {
                 if (Log::minLogLevel <= Log::Warn) {
                     std::string str = Client::format("since epoch: %llu preprocess time: %llu (slot time: %llu)",
-                                                     milliseconds_since_epoch, preprocessedDuration, preprocessedSlotDuration);
+                                                     milliseconds_since_epoch, data.preprocessDuration, data.preprocessSlotDuration);
                     for (size_t i=Watchdog::ConnectedToScheduler; i<=Watchdog::Finished; ++i) {
                         str += Client::format(" %s: %llu (%llu)\n", Watchdog::stageName(static_cast<Watchdog::Stage>(i)),
                                               watchdog->timings[i] - watchdog->timings[i - 1],
@@ -51,43 +54,20 @@ int main(int argc, char **argv)
     if (!Config::init(argc, argv)) {
         return 1;
     }
+    Client::phase(Client::ConfigLoaded);
     if (Config::help) {
         Config::usage(stdout);
         return 0;
     }
     if (Config::dumpSemaphores) {
-#ifdef __APPLE__
-        fprintf(stderr, "sem_getvalue(2) is not functional on mac so this option doesn't work\n");
-#else
-        for (Client::Slot::Type type : { Client::Slot::Compile, Client::Slot::Cpp, Client::Slot::DesiredCompile }) {
-            if (Client::Slot::slots(type) == std::numeric_limits<size_t>::max()) {
-                continue;
-            }
-            sem_t *sem = sem_open(Client::Slot::typeToString(type), O_CREAT, 0666, Client::Slot::slots(type));
-            if (!sem) {
-                fprintf(stderr, "Failed to open semaphore %s slots: %zu: %d %s\n",
-                        Client::Slot::typeToString(type), Client::Slot::slots(type),
-                        errno, strerror(errno));
-                continue;
-            }
-            int val = -1;
-            sem_getvalue(sem, &val);
-            printf("%s %d/%zu\n", Client::Slot::typeToString(type), val, Client::Slot::slots(type));
-            sem_close(sem);
-        }
-#endif
+        SlotBroker::dump(stdout);
         return 0;
     }
     if (Config::cleanSemaphores) {
-        for (Client::Slot::Type type : { Client::Slot::Compile, Client::Slot::Cpp, Client::Slot::DesiredCompile }) {
-            if (sem_unlink(Client::Slot::typeToString(type))) {
-                if (Client::Slot::slots(type) != std::numeric_limits<size_t>::max()) {
-                    fprintf(stderr, "Failed to unlink semaphore %s: %d %s\n",
-                            Client::Slot::typeToString(type), errno, strerror(errno));
-                }
-            }
-        }
-        return 0;
+        // the semaphores are from fiskc versions before the slot broker
+        for (const char *name : { "/fisk.compile", "/fisk.cpp", "/fisk.desiredCompile" })
+            sem_unlink(name);
+        return SlotBroker::clean() ? 0 : 1;
     }
 
     Watchdog watchdog;
@@ -95,15 +75,6 @@ int main(int argc, char **argv)
     data.argv = argv;
     data.argc = argc;
     data.watchdog = &watchdog;
-    auto signalHandler = [](int) {
-        for (sem_t *semaphore : Client::data().semaphores) {
-            sem_post(semaphore);
-        }
-        _exit(1);
-    };
-    for (int signal : { SIGINT, SIGHUP, SIGQUIT, SIGILL, SIGABRT, SIGFPE, SIGSEGV, SIGALRM, SIGTERM }) {
-        std::signal(signal, signalHandler);
-    }
 
     std::string clientName = Config::name;
 
@@ -117,31 +88,46 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    {
+        const std::string priority = Config::priority;
+        bool ok;
+        Client::stringToPriority(priority.c_str(), &ok);
+        if (!ok) {
+            fprintf(stderr, "Invalid priority: %s (\"interactive\", \"normal\" or \"background\")\n", priority.c_str());
+            return 1;
+        }
+    }
     if (Config::verbose)
         level = Log::Debug;
     std::string preresolved = Config::compiler;
 
     Log::init(level, Config::logFile, Config::logFileAppend ? Log::Append : Log::Overwrite);
+    Client::phase(Client::LogOpened);
+
+    if (Config::daemon)
+        return Daemon::exec();
 
     if (!Client::findCompiler(preresolved)) {
         ERROR("Can't find executable for %s", data.argv[0]);
         return 1;
     }
+    Client::phase(Client::CompilerResolved);
     DEBUG("Resolved compiler %s (%s) to \"%s\" \"%s\" \"%s\")",
           data.argv[0], preresolved.c_str(),
           data.compiler.c_str(), data.resolvedCompiler.c_str(),
           data.slaveCompiler.c_str());
 
-    if (!Config::noDesire) {
+    // with the cost model a desired slot is only used if it doesn't know better
+    if (!Config::noDesire && !Config::costModel) {
         if (std::unique_ptr<Client::Slot> slot = Client::tryAcquireSlot(Client::Slot::DesiredCompile)) {
-            Client::runLocal(std::move(slot));
+            Client::runLocal(std::move(slot), "desired slot");
             return 0;
         }
     }
 
     if (Config::disabled) {
         DEBUG("Have to run locally because we're disabled");
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "disabled");
         return 0; // unreachable
     }
 
@@ -153,9 +139,10 @@ int main(int argc, char **argv)
         }
         data.compilerArgs = CompilerArgs::create(args);
     }
+    Client::phase(Client::ArgumentsParsed);
     if (!data.compilerArgs) {
         DEBUG("Have to run locally");
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "unsupported arguments");
         return 0; // unreachable
     }
 
@@ -166,20 +153,148 @@ int main(int argc, char **argv)
     act.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &act, 0);
 
+    const bool objectCache = Config::objectCache && !Config::objectCacheDir().empty();
+    const time_t preprocessStarted = time(0);
+    std::string directKey;
+    if (objectCache) {
+        // the direct lookup needs it before cpp runs, otherwise the
+        // compiler is hashed while cpp is running
+        data.hash = Client::environmentHash(data.resolvedCompiler);
+        Client::phase(Client::EnvironmentHashed);
+        directKey = ObjectCache::directKey(data.hash, data.compilerArgs->commandLine, data.compilerArgs->sourceFile());
+        ObjectCache::Manifest manifest;
+        ObjectCache::Entry entry;
+        if (!directKey.empty() && ObjectCache::lookup(directKey, manifest, entry)) {
+            entry.files.insert(entry.files.end(), manifest.files.begin(), manifest.files.end());
+            entry.stdErr += manifest.cppStdErr;
+            if (ObjectCache::materialize(entry)) {
+                watchdog.stop();
+                data.cacheHit = true;
+                data.exitCode = entry.exitCode;
+                Client::writeTrace();
+                return entry.exitCode;
+            }
+        }
+    }
+
     std::unique_ptr<Client::Preprocessed> preprocessed = Client::preprocess(data.compiler, data.compilerArgs);
+    data.preprocessed = preprocessed.get();
     if (!preprocessed) {
         ERROR("Failed to preprocess");
         watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "preprocess failed");
         return 0; // unreachable
     }
 
-    data.hash = Client::environmentHash(data.resolvedCompiler);
+    if (!objectCache) {
+        data.hash = Client::environmentHash(data.resolvedCompiler);
+        Client::phase(Client::EnvironmentHashed);
+    }
+
+    std::string objectCacheKey;
+    auto storeManifest = [&]() {
+        if (directKey.empty())
+            return;
+        ObjectCache::Manifest manifest;
+        manifest.resultKey = objectCacheKey;
+        manifest.cppStdErr = preprocessed->stdErr;
+        std::set<std::string> includes;
+        ObjectCache::includedFiles(preprocessed.get(), includes);
+        if (!preprocessed->depFile.empty()) {
+            if (!ObjectCache::addFile(manifest.files, preprocessed->depFile))
+                return;
+            if (includes.empty()) // -P, no linemarkers
+                ObjectCache::parseDepFile(manifest.files.back().contents, includes);
+        }
+        if (!includes.empty() && ObjectCache::addHeaders(manifest, includes, preprocessStarted))
+            ObjectCache::storeManifest(directKey, manifest);
+    };
+    if (objectCache) {
+        // The key needs all of the preprocessed output so we can't overlap
+        // preprocessing with talking to the scheduler when the cache is on.
+        preprocessed->wait();
+        if (preprocessed->exitStatus != 0) {
+            ERROR("Failed to preprocess. Running locally");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "preprocess failed");
+            return 0; // unreachable
+        }
+        objectCacheKey = ObjectCache::key(data.hash, data.compilerArgs->commandLine, preprocessed->hash);
+        ObjectCache::Entry entry;
+        if (ObjectCache::load(objectCacheKey, entry) && ObjectCache::materialize(entry)) {
+            storeManifest();
+            if (!preprocessed->stdErr.empty()) {
+                fwrite(preprocessed->stdErr.c_str(), sizeof(char), preprocessed->stdErr.size(), stderr);
+            }
+            watchdog.stop();
+            data.cacheHit = true;
+            data.exitCode = entry.exitCode;
+            Client::writeTrace();
+            return entry.exitCode;
+        }
+        watchdog.restart();
+    }
+
+    if (Config::costModel) {
+        // Deciding needs the preprocessed size so it can't overlap with talking
+        // to the scheduler, not worth waiting for unless we could build locally
+        // and the model can decide or needs local samples. Until it has
+        // enough remote samples jobs go remote without waiting. Preprocessing
+        // can be waiting for memory that processes waiting for a compile
+        // slot hold so we only look for a free slot before waiting and take
+        // one after.
+        const CostModel::Choice undersampled = CostModel::undersampled();
+        auto tryAcquire = [undersampled](bool &desired) {
+            std::unique_ptr<Client::Slot> slot;
+            if (!Config::noDesire)
+                slot = Client::tryAcquireSlot(Client::Slot::DesiredCompile);
+            desired = slot != nullptr;
+            if (!slot && undersampled != CostModel::Remote)
+                slot = Client::tryAcquireSlot(Client::Slot::Compile);
+            return slot;
+        };
+        bool desired = false;
+        std::unique_ptr<Client::Slot> slot;
+        if (tryAcquire(desired)) {
+            preprocessed->wait();
+            slot = tryAcquire(desired);
+        }
+        if (slot) {
+            data.preprocessDuration = preprocessed->duration;
+            data.preprocessSlotDuration = preprocessed->slotDuration;
+            data.preprocessedBytes = preprocessed->size();
+            if (preprocessed->exitStatus != 0) {
+                ERROR("Failed to preprocess. Running locally");
+                watchdog.stop();
+                Client::runLocal(std::move(slot), "preprocess failed");
+                return 0; // unreachable
+            }
+            if (undersampled == CostModel::Local) {
+                // the size is what makes it a sample
+                watchdog.stop();
+                Client::runLocal(std::move(slot), "cost model sample");
+                return 0; // unreachable
+            }
+            const CostModel::Choice choice = CostModel::choose(data.preprocessedBytes);
+            if (choice == CostModel::Local || (choice == CostModel::Unknown && desired)) {
+                watchdog.stop();
+                Client::runLocal(std::move(slot), choice == CostModel::Local ? "cost model" : "desired slot");
+                return 0; // unreachable
+            }
+            watchdog.restart();
+        }
+    }
+
+    Speculation speculation;
+    data.speculation = &speculation;
+    speculation.start(preprocessed.get());
+
     std::map<std::string, std::string> headers;
     headers["x-fisk-environments"] = data.hash; // always a single one but fisk-slave sends multiple so we'll just keep it like this for now
     Client::parsePath(data.compilerArgs->sourceFile(), &headers["x-fisk-sourcefile"], 0);
     headers["x-fisk-client-name"] = Config::name;
     headers["x-fisk-config-version"] = std::to_string(Config::Version);
+    headers["x-fisk-priority"] = Client::priorityToString(Client::priority());
     {
         std::string slave = Config::slave;
         if (!slave.empty())
@@ -190,25 +305,28 @@ int main(int argc, char **argv)
         if (!hostname.empty())
             headers["x-fisk-client-hostname"] = std::move(hostname);
     }
-    std::string url = Config::scheduler;
-    if (url.find("://") == std::string::npos)
-        url.insert(0, "ws://");
-
-    std::regex regex(":[0-9]+$", std::regex_constants::ECMAScript);
-    if (!std::regex_search(url, regex))
-        url.append(":8097");
-
-    if (!schedulerWebsocket.connect(url + "/compile", headers)) {
-        DEBUG("Have to run locally because no server");
-        watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
-        return 0; // unreachable
-    }
+    // the build tool can start another job while this one is remote, a
+    // speculative compile keeps the token
+    if (!speculation.isRunning())
+        Jobserver::lend();
+
+    const unsigned long long remoteStarted = Client::mono();
+    if (Daemon::requestSlave(headers, schedulerWebsocket)) {
+        DEBUG("Got slave from daemon");
+        Client::phase(Client::SchedulerConnected);
+    } else {
+        if (!schedulerWebsocket.connect(Client::schedulerUrl() + "/compile", headers)) {
+            DEBUG("Have to run locally because no server");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "no scheduler");
+            return 0; // unreachable
+        }
+        Client::phase(Client::SchedulerRequested);
 
-    {
         Select select;
         select.add(&watchdog);
         select.add(&schedulerWebsocket);
+        select.add(&speculation);
 
         DEBUG("Starting schedulerWebsocket");
         while (!schedulerWebsocket.done
@@ -220,26 +338,11 @@ int main(int argc, char **argv)
         if (!schedulerWebsocket.done) {
             DEBUG("Have to run locally because no server 2");
             watchdog.stop();
-            Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "no scheduler");
             return 0; // unreachable
         }
     }
 
-    if (data.maintainSemaphores) {
-        for (Client::Slot::Type type : { Client::Slot::Compile, Client::Slot::Cpp, Client::Slot::DesiredCompile }) {
-            if (Client::Slot::slots(type) != std::numeric_limits<size_t>::max() && sem_unlink(Client::Slot::typeToString(type))) {
-                if (errno != ENOENT) {
-                    ERROR("Failed to unlink semaphore %s: %d %s",
-                          Client::Slot::typeToString(type), errno, strerror(errno));
-                } else {
-                    DEBUG("Semaphore %s didn't exist", Client::Slot::typeToString(type));
-                }
-            } else {
-                DEBUG("Destroyed semaphore %s", Client::Slot::typeToString(type));
-            }
-        }
-    }
-
     if (schedulerWebsocket.needsEnvironment) {
         watchdog.stop();
         const std::string tarball = Client::prepareEnvironmentForUpload();
@@ -247,7 +350,7 @@ int main(int argc, char **argv)
         if (!tarball.empty()) {
             Client::uploadEnvironment(&schedulerWebsocket, tarball);
         }
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "needs environment");
         return 0;
     }
 
@@ -255,44 +358,36 @@ int main(int argc, char **argv)
         || !schedulerWebsocket.slavePort) {
         DEBUG("Have to run locally because no slave");
         watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "no slave");
         return 0; // unreachable
     }
 
     // usleep(1000 * 1000 * 16);
     watchdog.transition(Watchdog::AcquiredSlave);
+    data.slave = Client::format("%s:%d", schedulerWebsocket.slaveHostname.empty() ? schedulerWebsocket.slaveIp.c_str() : schedulerWebsocket.slaveHostname.c_str(),
+                                schedulerWebsocket.slavePort);
     SlaveWebSocket slaveWebSocket;
+    slaveWebSocket.holdOutput = speculation.isRunning();
     Select select;
     select.add(&slaveWebSocket);
     select.add(&watchdog);
+    select.add(&speculation);
     headers["x-fisk-job-id"] = std::to_string(schedulerWebsocket.jobId);
     headers["x-fisk-slave-ip"] = schedulerWebsocket.slaveIp;
-    if (!slaveWebSocket.connect(Client::format("ws://%s:%d/compile",
-                                               schedulerWebsocket.slaveHostname.empty() ? schedulerWebsocket.slaveIp.c_str() : schedulerWebsocket.slaveHostname.c_str(),
-                                               schedulerWebsocket.slavePort), headers)) {
+    if (Config::compressionLevel)
+        headers["x-fisk-compression"] = "deflate";
+    if (!slaveWebSocket.connect("ws://" + data.slave + "/compile", headers)) {
         DEBUG("Have to run locally because no slave connection");
         watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "no slave connection");
         return 0; // unreachable
     }
 
     while (slaveWebSocket.state() < SchedulerWebSocket::ConnectedWebSocket)
         select.exec();
     watchdog.transition(Watchdog::ConnectedToSlave);
-
-    DEBUG("Waiting for preprocessed");
-    preprocessed->wait();
-    watchdog.transition(Watchdog::PreprocessFinished);
-    DEBUG("Preprocessed finished");
-    preprocessedDuration = preprocessed->duration;
-    preprocessedSlotDuration = preprocessed->slotDuration;
-
-    if (preprocessed->exitStatus != 0) {
-        ERROR("Failed to preprocess. Running locally");
-        watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
-        return 0; // unreachable
-    }
+    // otherwise the upload includes waiting for the preprocessor
+    const bool preprocessedBeforeUpload = preprocessed->isFinished();
 
     std::vector<std::string> args = data.compilerArgs->commandLine;
     args[0] = data.slaveCompiler;
@@ -301,17 +396,45 @@ int main(int argc, char **argv)
     json11::Json::object msg {
         { "commandLine", args },
         { "argv0", data.compiler },
-        { "wait", wait },
-        { "bytes", static_cast<int>(preprocessed->stdOut.size()) }
-    };
+        { "wait", wait }
+    }; // no "bytes", the preprocessed output is streamed and terminated by an empty binary message
+
+    bool sharedObjectCache = false;
+    if (Config::sharedObjectCache && slaveWebSocket.handshakeResponseHeader("x-fisk-object-cache") == "true") {
+        // The slave either answers with a cached response or tells us to
+        // resume, in which case we upload as usual.
+        preprocessed->wait();
+        if (preprocessed->exitStatus != 0) {
+            ERROR("Failed to preprocess. Running locally");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "preprocess failed");
+            return 0; // unreachable
+        }
+        if (objectCacheKey.empty())
+            objectCacheKey = ObjectCache::key(data.hash, data.compilerArgs->commandLine, preprocessed->hash);
+        msg["cacheKey"] = objectCacheKey;
+        sharedObjectCache = true;
+    }
+
+    const int compressionLevel = Config::compressionLevel;
+    Deflater deflater;
+    if (compressionLevel
+        && slaveWebSocket.handshakeResponseHeader("x-fisk-compression") == "deflate"
+        && deflater.init(compressionLevel > 0 ? compressionLevel : 1)) {
+        msg["compression"] = "deflate";
+        slaveWebSocket.compressed = true;
+    }
 
     const std::string json = json11::Json(msg).dump();
-    slaveWebSocket.wait = wait;
+    slaveWebSocket.wait = wait || sharedObjectCache;
     slaveWebSocket.send(WebSocket::Text, json.c_str(), json.size());
-    if (wait) {
-        while ((slaveWebSocket.hasPendingSendData() || slaveWebSocket.wait) && slaveWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket)
+    if (slaveWebSocket.wait) {
+        while ((slaveWebSocket.hasPendingSendData() || slaveWebSocket.wait)
+               && !slaveWebSocket.done
+               && slaveWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
             select.exec();
-        if (slaveWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
+        }
+        if (!slaveWebSocket.done && slaveWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
             DEBUG("Have to run locally because something went wrong with the slave");
             watchdog.stop();
             Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
@@ -319,19 +442,107 @@ int main(int argc, char **argv)
         }
     }
 
-    assert(!slaveWebSocket.wait);
-    slaveWebSocket.send(WebSocket::Binary, preprocessed->stdOut.c_str(), preprocessed->stdOut.size());
+    if (slaveWebSocket.done) {
+        DEBUG("Slave had a cached result");
+        watchdog.transition(Watchdog::PreprocessFinished);
+        data.preprocessDuration = preprocessed->duration;
+        data.preprocessSlotDuration = preprocessed->slotDuration;
+        data.preprocessedBytes = preprocessed->size();
+    } else {
+        assert(!slaveWebSocket.wait);
+        DEBUG("Streaming preprocessed");
+        preprocessed->setChunkCallback([&select]() { select.wakeup(); });
+        size_t chunk = 0;
+        std::string compressed;
+        unsigned long long measureTime = Client::mono(), measureBytes = slaveWebSocket.bytesWritten();
+        auto adaptCompressionLevel = [&]() {
+            const unsigned long long now = Client::mono();
+            if (!slaveWebSocket.hasPendingSendData()) {
+                // the link keeps up with us, spend as little time compressing as possible
+                measureTime = now;
+                measureBytes = slaveWebSocket.bytesWritten();
+                deflater.setLevel(1);
+            } else if (now - measureTime >= 50) {
+                const unsigned long long bytesPerSecond = (slaveWebSocket.bytesWritten() - measureBytes) * 1000 / (now - measureTime);
+                measureTime = now;
+                measureBytes = slaveWebSocket.bytesWritten();
+                deflater.setLevel(Deflater::levelForLinkSpeed(bytesPerSecond));
+            }
+        };
+        while (slaveWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket) {
+            const bool finished = preprocessed->isFinished();
+            const char *bytes;
+            size_t size;
+            while (preprocessed->chunk(chunk, bytes, size)) {
+                if (slaveWebSocket.compressed) {
+                    if (compressionLevel < 0)
+                        adaptCompressionLevel();
+                    compressed.clear();
+                    if (!deflater.compress(bytes, size, compressed)) {
+                        watchdog.stop();
+                        Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "compression failed");
+                        return 0; // unreachable
+                    }
+                    if (!compressed.empty()) // an empty message would terminate the upload
+                        slaveWebSocket.send(WebSocket::Binary, compressed.c_str(), compressed.size());
+                } else {
+                    // completed chunks stay put until preprocessed goes away
+                    slaveWebSocket.send(WebSocket::Binary, bytes, size, WebSocket::Borrow);
+                }
+                ++chunk;
+            }
+            if (finished)
+                break;
+            select.exec();
+        }
+        preprocessed->setChunkCallback(std::function<void()>());
+        if (slaveWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
+            DEBUG("Have to run locally because something went wrong with the slave");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+            return 0; // unreachable
+        }
+
+        preprocessed->wait();
+        watchdog.transition(Watchdog::PreprocessFinished);
+        DEBUG("Preprocessed finished");
+        data.preprocessDuration = preprocessed->duration;
+        data.preprocessSlotDuration = preprocessed->slotDuration;
+        data.preprocessedBytes = preprocessed->size();
 
-    while (slaveWebSocket.hasPendingSendData() && slaveWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket)
-        select.exec();
-    if (slaveWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
-        DEBUG("Have to run locally because something went wrong with the slave");
-        watchdog.stop();
-        Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
-        return 0; // unreachable
+        if (preprocessed->exitStatus != 0) {
+            ERROR("Failed to preprocess. Running locally");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "preprocess failed");
+            return 0; // unreachable
+        }
+
+        if (slaveWebSocket.compressed) {
+            compressed.clear();
+            if (!deflater.finish(compressed)) {
+                watchdog.stop();
+                Client::runLocal(Client::acquireSlot(Client::Slot::Compile), "compression failed");
+                return 0; // unreachable
+            }
+            if (!compressed.empty())
+                slaveWebSocket.send(WebSocket::Binary, compressed.c_str(), compressed.size());
+        }
+        slaveWebSocket.send(WebSocket::Binary, "", 0);
+
+        while (slaveWebSocket.hasPendingSendData() && slaveWebSocket.state() == SchedulerWebSocket::ConnectedWebSocket)
+            select.exec();
+        if (slaveWebSocket.state() != SchedulerWebSocket::ConnectedWebSocket) {
+            DEBUG("Have to run locally because something went wrong with the slave");
+            watchdog.stop();
+            Client::runLocal(Client::acquireSlot(Client::Slot::Compile));
+            return 0; // unreachable
+        }
     }
 
     watchdog.transition(Watchdog::UploadedJob);
+    // the manifest needs the includes from the preprocessed output
+    if (directKey.empty())
+        preprocessed->discard();
 
     // usleep(1000 * 500);
     // return 0;
@@ -344,12 +555,36 @@ int main(int argc, char **argv)
         return 0; // unreachable
     }
 
+    speculation.cancel();
+    if (slaveWebSocket.holdOutput) {
+        fwrite(slaveWebSocket.stdOut.c_str(), sizeof(char), slaveWebSocket.stdOut.size(), stdout);
+        fwrite(slaveWebSocket.stdErr.c_str(), sizeof(char), slaveWebSocket.stdErr.size(), stderr);
+    }
     if (!preprocessed->stdErr.empty()) {
         fwrite(preprocessed->stdErr.c_str(), sizeof(char), preprocessed->stdErr.size(), stderr);
     }
     watchdog.transition(Watchdog::Finished);
     watchdog.stop();
-    schedulerWebsocket.close("slaved");
+    if (preprocessedBeforeUpload && !wait && !sharedObjectCache) {
+        CostModel::addRemote(data.preprocessedBytes, watchdog.timings[Watchdog::UploadedJob] - watchdog.timings[Watchdog::ConnectedToSlave],
+                             watchdog.timings[Watchdog::Finished] - remoteStarted, schedulerWebsocket.slaveCompileSpeed);
+    }
+    if (schedulerWebsocket.state() == SchedulerWebSocket::ConnectedWebSocket)
+        schedulerWebsocket.close("slaved");
+
+    if (objectCache && !objectCacheKey.empty() && !data.exitCode) {
+        ObjectCache::Entry entry;
+        entry.stdOut = std::move(slaveWebSocket.stdOut);
+        entry.stdErr = std::move(slaveWebSocket.stdErr);
+        bool ok = true;
+        for (const std::string &output : slaveWebSocket.outputs) {
+            if (!(ok = ObjectCache::addFile(entry.files, output)))
+                break;
+        }
+        if (ok && ObjectCache::store(objectCacheKey, entry))
+            storeManifest();
+    }
 
+    Client::writeTrace();
     return data.exitCode;
 }
@@ -2,7 +2,7 @@ const fs = require('fs-extra');
 const path = require('path');
 const os = require('os');
 
-const Version = 5;
+const Version = 6;
 
 function cacheDir(option)
 {
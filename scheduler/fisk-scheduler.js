@@ -42,6 +42,7 @@ function slaveToMonitorInfo(slave, type)
         slots: slave.slots,
         port: slave.port,
         jobsPerformed: slave.jobsPerformed,
+        cacheHits: slave.cacheHits,
         compileSpeed: slave.jobsPerformed / slave.totalCompileSpeed || 0,
         uploadSpeed: slave.jobsPerformed / slave.totalUploadSpeed || 0,
         system: slave.system,
@@ -207,6 +208,7 @@ server.on("listen", app => {
                 jobsScheduled: s.jobsScheduled,
                 lastJob: s.lastJob ? new Date(s.lastJob).toString() : "",
                 jobsPerformed: s.jobsPerformed,
+                cacheHits: s.cacheHits,
                 compileSpeed: s.jobsPerformed / s.totalCompileSpeed || 0,
                 uploadSpeed: s.jobsPerformed / s.totalUploadSpeed || 0,
                 hostname: s.hostname,
@@ -310,9 +312,13 @@ server.on("slave", slave => {
     });
 
     slave.on("jobFinished", job => {
-        ++slave.jobsPerformed;
-        slave.totalCompileSpeed += job.compileSpeed;
-        slave.totalUploadSpeed += job.uploadSpeed;
+        if (job.cacheHit) {
+            ++slave.cacheHits;
+        } else {
+            ++slave.jobsPerformed;
+            slave.totalCompileSpeed += job.compileSpeed;
+            slave.totalUploadSpeed += job.uploadSpeed;
+        }
         // console.log(`slave: ${slave.ip}:${slave.port} performed a job`, job);
         if (monitors.length) {
             const info = {
@@ -322,7 +328,8 @@ server.on("slave", slave => {
                 compileDuration: job.compileDuration,
                 compileSpeed: job.compileSpeed,
                 uploadDuration: job.uploadDuration,
-                uploadSpeed: job.uploadSpeed
+                uploadSpeed: job.uploadSpeed,
+                cacheHit: job.cacheHit
             };
             // console.log("send to monitors", info);
             monitors.forEach(monitor => monitor.send(info));
@@ -465,6 +472,11 @@ server.on("compile", compile => {
                 slaveScore = Infinity;
             } else {
                 slaveScore = score(s);
+                // background builds only get slaves that have a slot to
+                // spare, they build locally rather than queue on a slave
+                // in front of someone's interactive build
+                if (compile.priority == "background" && slaveScore <= 0)
+                    return;
             }
             // console.log("comparing", slaveScore, bestScore);
             if (!slave || slaveScore > bestScore || (slaveScore == bestScore && s.lastJob < slave.lastJob)) {
@@ -500,6 +512,8 @@ server.on("compile", compile => {
         data.ip = slave.ip;
         data.hostname = slave.hostname;
         data.port = slave.port;
+        // bytes per ms, the client uses it to decide whether building remotely is worth it
+        data.compileSpeed = slave.jobsPerformed ? slave.totalCompileSpeed / slave.jobsPerformed : 0;
         compile.send("slave", data);
     } else {
         console.log("No slave for you", compile.ip);
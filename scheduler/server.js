@@ -42,11 +42,40 @@ class Client extends EventEmitter {
     }
 };
 
+// A compile requested through a fiskc daemon. Messages are multiplexed over
+// the daemon's connection and tagged with the daemon's request id.
+class DaemonRequest extends Client {
+    constructor(daemon, requestId, obj) {
+        super(obj);
+        this.daemon = daemon;
+        this.requestId = requestId;
+    }
+
+    send(type, msg) {
+        let tosend;
+        if (msg === undefined) {
+            tosend = type;
+        } else if (typeof msg === "object") {
+            tosend = msg;
+            tosend.type = type;
+        } else {
+            tosend = { type: type, message: msg };
+        }
+        tosend.requestId = this.requestId;
+        this.daemon.send(tosend);
+    }
+
+    close() {
+        this.emit("close");
+    }
+};
+
 Client.Type = {
     Slave: 0,
     Compile: 1,
     UploadEnvironment: 2,
-    Monitor: 3
+    Monitor: 3,
+    Daemon: 4
 };
 
 class Server extends EventEmitter {
@@ -160,6 +189,9 @@ class Server extends EventEmitter {
             const clientHostname = req.headers["x-fisk-client-hostname"];
             if (clientHostname)
                 data.hostname = clientHostname;
+            const priority = req.headers["x-fisk-priority"];
+            if (priority)
+                data.priority = priority;
             client = new Client(data);
             this.emit("compile", client);
             ws.on('close', (status, reason) => client.emit('close', status, reason));
@@ -237,6 +269,69 @@ class Server extends EventEmitter {
                 }
             });
             break;
+        case "/daemon": {
+            const daemonConfigVersion = req.headers["x-fisk-config-version"];
+            if (daemonConfigVersion != this.configVersion) {
+                error(`Bad config version, expected ${this.configVersion}, got ${daemonConfigVersion}`);
+                return;
+            }
+            client = new Client({ ws: ws,
+                                  ip: ip,
+                                  type: Client.Type.Daemon,
+                                  name: req.headers["x-fisk-client-name"],
+                                  hostname: req.headers["x-fisk-client-hostname"] });
+            let requests = {};
+            ws.on("message", msg => {
+                let json;
+                try {
+                    json = JSON.parse(msg);
+                } catch (e) {
+                }
+                if (json === undefined || !json.requestId) {
+                    error("Unable to parse daemon message");
+                    return;
+                }
+                switch (json.type) {
+                case "requestSlave": {
+                    const headers = json.headers || {};
+                    if (!headers["x-fisk-environments"]) {
+                        client.send({ type: "error", requestId: json.requestId, message: "No x-fisk-environments header" });
+                        return;
+                    }
+                    let data = {
+                        ip: ip,
+                        type: Client.Type.Compile,
+                        environments: headers["x-fisk-environments"].replace(/\s+/g, '').split(';').filter(x => x),
+                        sourceFile: headers["x-fisk-sourcefile"],
+                        name: headers["x-fisk-client-name"] || client.name,
+                        hostname: headers["x-fisk-client-hostname"] || client.hostname
+                    };
+                    if (headers["x-fisk-slave"])
+                        data.slave = headers["x-fisk-slave"];
+                    if (headers["x-fisk-priority"])
+                        data.priority = headers["x-fisk-priority"];
+                    const request = new DaemonRequest(client, json.requestId, data);
+                    requests[json.requestId] = request;
+                    request.once("close", () => { delete requests[json.requestId]; });
+                    this.emit("compile", request);
+                    break; }
+                case "release":
+                    if (json.requestId in requests)
+                        requests[json.requestId].close();
+                    break;
+                default:
+                    error(`Unexpected daemon message ${json.type}`);
+                    break;
+                }
+            });
+            ws.on("close", () => {
+                for (let id in requests)
+                    requests[id].close();
+                requests = {};
+                ws.removeAllListeners();
+            });
+            ws.on("error", err => console.error(`daemon error from ${ip}`, err));
+            break; }
         case "/slave":
             if (!("x-fisk-port" in req.headers)) {
                 error("No x-fisk-port header");
@@ -277,6 +372,7 @@ class Server extends EventEmitter {
                                   name: name,
                                   slots: slots,
                                   jobsPerformed: 0,
+                                  cacheHits: 0,
                                   jobsScheduled: 0,
                                   totalCompileSpeed: 0,
                                   totalUploadSpeed: 0,
@@ -5,9 +5,12 @@ const common = require("../common")(option);
 const Server = require("./server");
 const Client = require("./client");
 const Compile = require("./compile");
+const ObjectCache = require("./objectcache");
 const fs = require("fs-extra");
 const path = require("path");
 const os = require("os");
+const crypto = require("crypto");
+const zlib = require("zlib");
 const child_process = require("child_process");
 const VM = require("./VM");
 const load = require("./load");
@@ -281,12 +284,42 @@ client.on("close", () => {
 
 const server = new Server(option, common.Version);
 let jobQueue = [];
+let objectCache;
+if (option.int("object-cache-size", 4096) > 0) {
+    try {
+        objectCache = new ObjectCache(path.join(common.cacheDir(), "objects"), option.int("object-cache-size", 4096) * 1024 * 1024);
+    } catch (err) {
+        console.error(`Failed to initialize object cache ${err.message}`);
+    }
+}
 
 server.on('headers', (headers, request) => {
     // console.log("request is", request.headers);
     headers.push(`x-fisk-wait: ${jobQueue.length >= client.slots}`);
+    if (objectCache)
+        headers.push("x-fisk-object-cache: true");
 });
 
+// contents is an array of { path, contents }
+function sendResponse(job, contents, success, exitCode)
+{
+    job.send({
+        type: "response",
+        index: contents.map(item => { return { path: item.path, bytes: item.contents.length }; }),
+        success: success,
+        exitCode: exitCode
+    });
+
+    if (job.compression == "deflate") {
+        job.send(zlib.deflateRawSync(Buffer.concat(contents.map(item => item.contents)),
+                                     { level: option.int("compression-level", 1) }));
+    } else {
+        for (let i=0; i<contents.length; ++i) {
+            job.send(contents[i].contents);
+        }
+    }
+}
+
 function startPending()
 {
     // console.log(`startPending called ${jobQueue.length}`);
@@ -325,6 +358,25 @@ server.on("job", (job) => {
             port: server.port
         }
     });
+    const cacheKey = objectCache && ObjectCache.isValidKey(job.cacheKey) ? job.cacheKey : undefined;
+    if (cacheKey) {
+        const cached = objectCache.get(cacheKey);
+        if (cached) {
+            console.log("Object cache hit", job.id, job.sourceFile, "for", job.ip, job.name);
+            job.cacheHit = true;
+            if (cached.stdout)
+                job.send({ type: "stdout", data: cached.stdout });
+            if (cached.stderr)
+                job.send({ type: "stderr", data: cached.stderr });
+            sendResponse(job, cached.index.map((item, idx) => { return { path: item.path, contents: cached.contents[idx] }; }),
+                         true, cached.exitCode);
+            client.send("jobFinished", { id: job.id, cacheHit: true });
+            return;
+        }
+        // the client waits for a resume before uploading anything
+        job.wait = true;
+    }
+
     // console.log("sending to server");
     var j = {
         id: job.id,
@@ -333,6 +385,9 @@ server.on("job", (job) => {
         done: false,
         heartbeatTimer: undefined,
         buffers: [],
+        stdout: "",
+        stderr: "",
+        sha: cacheKey ? crypto.createHash("sha1") : undefined,
         start: function() {
             let job = this.job;
             this.heartbeatTimer = setInterval(() => {
@@ -346,8 +401,16 @@ server.on("job", (job) => {
                 job.send("resume", {});
             }
             delete this.buffers;
-            this.op.on("stdout", data => job.send({ type: "stdout", data: data }));
-            this.op.on("stderr", data => job.send({ type: "stderr", data: data }));
+            this.op.on("stdout", data => {
+                if (cacheKey)
+                    this.stdout += data;
+                job.send({ type: "stdout", data: data });
+            });
+            this.op.on("stderr", data => {
+                if (cacheKey)
+                    this.stderr += data;
+                job.send({ type: "stderr", data: data });
+            });
             this.op.on("finished", event => {
                 this.done = true;
                 let idx = jobQueue.indexOf(j);
@@ -361,15 +424,20 @@ server.on("job", (job) => {
 
                 // this can't be async, the directory is removed after the event is fired
                 let contents = event.files.map(f => { return { contents: fs.readFileSync(f.absolute), path: f.path }; });
-                job.send({
-                    type: "response",
-                    index: contents.map(item => { return { path: item.path, bytes: item.contents.length }; }),
-                    success: event.success,
-                    exitCode: event.exitCode
-                });
-
-                for (let i=0; i<contents.length; ++i) {
-                    job.send(contents[i].contents);
+                sendResponse(job, contents, event.success, event.exitCode);
+                if (cacheKey && event.success && event.exitCode === 0) {
+                    // only trust the client's key if it matches what we compiled
+                    if (ObjectCache.key(job.hash, job.commandLine, this.sha.digest()) == cacheKey) {
+                        objectCache.put(cacheKey, {
+                            index: contents.map(item => { return { path: item.path, bytes: item.contents.length }; }),
+                            exitCode: event.exitCode,
+                            stdout: this.stdout,
+                            stderr: this.stderr,
+                            contents: contents.map(item => item.contents)
+                        });
+                    } else {
+                        console.error("Object cache key mismatch for", job.sourceFile, "from", job.ip, job.name);
+                    }
                 }
                 if (this.heartbeatTimer) {
                     clearTimeout(this.heartbeatTimer);
@@ -420,6 +488,8 @@ server.on("job", (job) => {
         // console.log("got data", this.id, data.last, typeof j.op);
         if (data.last)
             uploadDuration = Date.now() - jobStartTime;
+        if (j.sha)
+            j.sha.update(data.data);
         if (!j.op) {
             j.buffers.push(data);
             console.log("buffering...", j.buffers.length);
@@ -0,0 +1,152 @@
+const crypto = require("crypto");
+const fs = require("fs-extra");
+const path = require("path");
+
+// Keys are calculated like ObjectCache::key in the client so that a result
+// is only ever stored under the key of what we actually compiled.
+const preprocessorOptions = [ "-D", "-I", "-U", "-idirafter", "-imacros", "-include", "-iprefix",
+                              "-iquote", "-isystem", "-iwithprefix", "-iwithprefixbefore" ];
+const joinedPreprocessorOptions = [ "-D", "-I", "-U", "-idirafter", "-iquote", "-isystem" ];
+
+function key(environmentHash, commandLine, preprocessedHash)
+{
+    let hash = crypto.createHash("sha1");
+    hash.update(environmentHash);
+    hash.update("\0");
+    for (let i=1; i<commandLine.length; ++i) {
+        const arg = commandLine[i];
+        if (preprocessorOptions.indexOf(arg) != -1) {
+            ++i;
+            continue;
+        }
+        if (joinedPreprocessorOptions.some(opt => arg.startsWith(opt)))
+            continue;
+        hash.update(arg);
+        hash.update("\0");
+    }
+    hash.update(preprocessedHash);
+    return hash.digest("hex").toUpperCase();
+}
+
+// One file per entry, a 32 bit header length followed by a JSON header and
+// the contents of the files. Entries are kept in a Map in least recently
+// used order and the oldest ones are removed when we're above maxSize.
+class ObjectCache
+{
+    constructor(dir, maxSize) {
+        this.dir = dir;
+        this.maxSize = maxSize;
+        this.size = 0;
+        this.entries = new Map();
+
+        fs.mkdirpSync(dir);
+        let all = [];
+        fs.readdirSync(dir).forEach(sub => {
+            const subdir = path.join(dir, sub);
+            if (!fs.statSync(subdir).isDirectory())
+                return;
+            fs.readdirSync(subdir).forEach(file => {
+                const entry = path.join(subdir, file);
+                if (!/^[0-9A-F]+$/.test(file)) {
+                    fs.removeSync(entry); // stale temp file
+                    return;
+                }
+                const stat = fs.statSync(entry);
+                all.push({ key: sub + file, size: stat.size, mtime: stat.mtimeMs });
+            });
+        });
+        all.sort((a, b) => a.mtime - b.mtime).forEach(entry => {
+            this.entries.set(entry.key, entry.size);
+            this.size += entry.size;
+        });
+        this._purge();
+        console.log(`Object cache ${dir} has ${this.entries.size} entries, ${this.size} bytes`);
+    }
+
+    static isValidKey(k) {
+        return typeof k === "string" && /^[0-9A-F]{40}$/.test(k);
+    }
+
+    get(k) {
+        if (!this.entries.has(k))
+            return undefined;
+        const file = this._path(k);
+        try {
+            const data = fs.readFileSync(file);
+            const headerLength = data.readUInt32BE(0);
+            let ret = JSON.parse(data.toString("utf8", 4, 4 + headerLength));
+            let offset = 4 + headerLength;
+            ret.contents = ret.index.map(item => {
+                const contents = data.slice(offset, offset + item.bytes);
+                offset += item.bytes;
+                return contents;
+            });
+            if (offset != data.length)
+                throw new Error(`Size mismatch ${offset} vs ${data.length}`);
+            // move it to the back of the line
+            const size = this.entries.get(k);
+            this.entries.delete(k);
+            this.entries.set(k, size);
+            const now = new Date();
+            fs.utimes(file, now, now, () => {});
+            return ret;
+        } catch (err) {
+            console.error(`Failed to read object cache entry ${file}: ${err.message}`);
+            this._remove(k);
+            return undefined;
+        }
+    }
+
+    // result is { index, exitCode, stdout, stderr, contents }
+    put(k, result) {
+        const header = Buffer.from(JSON.stringify({ index: result.index,
+                                                    exitCode: result.exitCode,
+                                                    stdout: result.stdout,
+                                                    stderr: result.stderr }));
+        let headerLength = Buffer.allocUnsafe(4);
+        headerLength.writeUInt32BE(header.length, 0);
+        const data = Buffer.concat([ headerLength, header ].concat(result.contents));
+        if (data.length > this.maxSize)
+            return;
+        const file = this._path(k);
+        const tmp = `${file}.${process.pid}.tmp`;
+        fs.mkdirp(path.dirname(file)).then(() => {
+            return fs.writeFile(tmp, data);
+        }).then(() => {
+            return fs.rename(tmp, file);
+        }).then(() => {
+            if (this.entries.has(k)) {
+                this.size -= this.entries.get(k);
+                this.entries.delete(k);
+            }
+            this.entries.set(k, data.length);
+            this.size += data.length;
+            this._purge();
+        }).catch(err => {
+            console.error(`Failed to write object cache entry ${file}: ${err.message}`);
+            fs.remove(tmp).catch(() => {});
+        });
+    }
+
+    _path(k) {
+        return path.join(this.dir, k.substr(0, 2), k.substr(2));
+    }
+
+    _remove(k) {
+        if (!this.entries.has(k))
+            return;
+        this.size -= this.entries.get(k);
+        this.entries.delete(k);
+        fs.remove(this._path(k)).catch(err => {
+            console.error(`Failed to remove object cache entry ${k}: ${err.message}`);
+        });
+    }
+
+    _purge() {
+        while (this.size > this.maxSize && this.entries.size)
+            this._remove(this.entries.keys().next().value);
+    }
+}
+
+ObjectCache.key = key;
+module.exports = ObjectCache;
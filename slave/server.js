@@ -2,6 +2,7 @@
 const EventEmitter = require("events");
 const WebSocket = require("ws");
 const Url = require("url");
+const zlib = require("zlib");
 
 class Job extends EventEmitter {
     constructor(data) {
@@ -53,7 +54,11 @@ class Server extends EventEmitter {
         });
         console.log("listening on", this.ws.options.port);
         this.ws.on("connection", (ws, req) => { this._handleConnection(ws, req); });
-        this.ws.on('headers', (headers, request) => this.emit('headers', headers, request));
+        this.ws.on('headers', (headers, request) => {
+            if (/\bdeflate\b/.test(request.headers["x-fisk-compression"] || ""))
+                headers.push("x-fisk-compression: deflate");
+            this.emit('headers', headers, request);
+        });
     }
 
 
@@ -61,6 +66,8 @@ class Server extends EventEmitter {
         const connectTime = Date.now();
         let client = undefined;
         let bytes = undefined;
+        let streaming = false;
+        let inflate = undefined;
         let ip = req.connection.remoteAddress;
         const error = msg => {
             ws.send(`{"error": "${msg}"}`);
@@ -115,9 +122,9 @@ class Server extends EventEmitter {
             switch (typeof msg) {
             case "string":
                 // console.log("Got message", msg);
-                if (bytes) {
+                if (bytes || streaming) {
                     // bad, client have to send all the data in a binary message before sending JSON
-                    error(`Got JSON message while ${bytes} bytes remained of a binary message`);
+                    error(`Got JSON message while ${streaming ? "streaming" : bytes + " bytes remained of"} a binary message`);
                     return;
                 }
                 // assume JSON
@@ -130,16 +137,41 @@ class Server extends EventEmitter {
                     error("Unable to parse string message as JSON");
                     return;
                 }
+                // without bytes the data is streamed in chunks and terminated by an empty binary message
                 bytes = json.bytes;
+                streaming = bytes === undefined;
                 client.commandLine = json.commandLine;
                 client.argv0 = json.argv0;
                 client.connectTime = connectTime;
                 client.wait = json.wait;
+                client.compression = json.compression;
+                client.cacheKey = json.cacheKey;
+                if (streaming && client.compression == "deflate") {
+                    inflate = zlib.createInflateRaw();
+                    inflate.on("data", data => client.emit("data", { data: data, last: false }));
+                    inflate.on("end", () => client.emit("data", { data: Buffer.allocUnsafe(0), last: true }));
+                    inflate.on("error", err => error(`Failed to inflate data: ${err.message}`));
+                } else if (client.compression) {
+                    error(`Unsupported compression ${client.compression}`);
+                    return;
+                }
                 this.emit("job", client);
                 break;
             case "object":
                 if (msg instanceof Buffer) {
                     // console.log("Got binary", msg.length, bytes);
+                    if (streaming) {
+                        if (!msg.length)
+                            streaming = false;
+                        if (!inflate) {
+                            client.emit("data", { data: msg, last: !streaming });
+                        } else if (msg.length) {
+                            inflate.write(msg);
+                        } else {
+                            inflate.end();
+                        }
+                        return;
+                    }
                     if (!msg.length) {
                         // no data?
                         console.error("No data in buffer");
@@ -163,7 +195,7 @@ class Server extends EventEmitter {
         });
         ws.on("close", () => {
             // console.log("GOT WS CLOSE");
-            if (bytes)
+            if ((bytes || streaming) && !client.cacheHit)
                 client.emit("error", "Got close while reading a binary message");
             if (client)
                 client.emit("close");